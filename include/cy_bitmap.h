@@ -17,11 +17,13 @@ bool bitmap_test(const struct bitmap *b, size_t idx);
 
 void bitmap_set_all(struct bitmap *b, bool value);
 void bitmap_set_multiple(struct bitmap *b, size_t start, size_t cnt, bool value);
+size_t bitmap_count(const struct bitmap *b, size_t start, size_t cnt, bool value);
 bool bitmap_contains(const struct bitmap *b, size_t start, size_t cnt, bool value);
 bool bitmap_all(const struct bitmap *b, size_t start, size_t cnt);
 
 #define BITMAP_ERROR SIZE_MAX
 size_t bitmap_scan(const struct bitmap *b, size_t start, size_t cnt, bool value);
 size_t bitmap_scan_and_flip(struct bitmap *b, size_t start, size_t cnt, bool value);
+size_t bitmap_longest_run(const struct bitmap *b);
 
 #endif
@@ -0,0 +1,19 @@
+#ifndef CY_BUDDY_H
+#define CY_BUDDY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct buddy *buddy_create_in_buf(size_t page_cnt, void *block, size_t block_size);
+size_t buddy_buf_size(size_t page_cnt);
+
+#define BUDDY_ERROR SIZE_MAX
+size_t buddy_alloc(struct buddy *, size_t page_cnt);
+void buddy_free(struct buddy *, size_t page_idx, size_t page_cnt);
+bool buddy_resize(struct buddy *, size_t page_idx, size_t old_cnt, size_t new_cnt);
+
+size_t buddy_free_pages(const struct buddy *);
+size_t buddy_largest_free(const struct buddy *);
+
+#endif
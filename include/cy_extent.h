@@ -0,0 +1,19 @@
+#ifndef CY_EXTENT_H
+#define CY_EXTENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct extent_index *extent_create_in_buf(size_t page_cnt, void *block, size_t block_size);
+size_t extent_buf_size(size_t page_cnt);
+
+#define EXTENT_ERROR SIZE_MAX
+size_t extent_alloc(struct extent_index *, size_t page_cnt);
+void extent_free(struct extent_index *, size_t page_idx, size_t page_cnt);
+bool extent_resize(struct extent_index *, size_t page_idx, size_t old_cnt, size_t new_cnt);
+
+size_t extent_free_pages(const struct extent_index *);
+size_t extent_largest_free(const struct extent_index *);
+
+#endif
@@ -33,6 +33,7 @@ struct list
 void list_init(struct list *);
 
 struct list_elem *list_begin(struct list *);
+struct list_elem *list_next(struct list_elem *);
 struct list_elem *list_end(struct list *);
 
 void list_insert(struct list_elem *, struct list_elem *);
@@ -43,6 +44,7 @@ struct list_elem *list_remove(struct list_elem *);
 struct list_elem *list_pop_front(struct list *);
 
 struct list_elem *list_front(struct list *);
+struct list_elem *list_back(struct list *);
 
 bool list_empty(struct list *);
 #endif
@@ -1,12 +1,129 @@
 #ifndef CY_MALLOC_H
 #define CY_MALLOC_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
-void init_memory_allocator(uint32_t start_addr, uint32_t end_addr, uint32_t requested_size);
+/* Parameters for cy_mallopt(). */
+#define CY_M_ARENA_CACHE        1   /* Empty arenas kept per size class (4). */
+#define CY_M_ARENA_CACHE_TOTAL  2   /* Empty arenas kept in all (64). */
+#define CY_M_PAGE_ALLOC         3   /* Page allocator, set before init. */
+#define CY_M_PURGE_DECAY        4   /* Ms free pages stay resident (10000). */
+#define CY_M_PURGE_DIRTY_MAX    5   /* Free pages kept resident per pool. */
+#define CY_M_PURGE_LAZY         6   /* Purge with MADV_FREE if nonzero (0). */
+#define CY_M_PURGE_THREAD       7   /* Purge in the background if nonzero (0). */
+#define CY_M_HUGEPAGE           8   /* Huge page layout if nonzero, set before init. */
+#define CY_M_SIZE_CLASSES       9   /* Size class spacing, set before init. */
+#define CY_M_SIZE_SAMPLE        10  /* Sample one in VALUE request sizes (0, off). */
+#define CY_M_PROF_RATE          11  /* Heap profile one in VALUE bytes (0, off). */
+
+/* Page allocators for CY_M_PAGE_ALLOC. */
+#define CY_PALLOC_BITMAP        0   /* First fit in a bitmap (default). */
+#define CY_PALLOC_BUDDY         1   /* Power-of-two buddy system. */
+#define CY_PALLOC_EXTENT        2   /* Best fit over free extents. */
+
+/* Size class spacings for CY_M_SIZE_CLASSES. */
+#define CY_CLASSES_POW2         0   /* One per power of two (default). */
+#define CY_CLASSES_QUARTER      1   /* Four per doubling. */
+
+void init_memory_allocator(uintptr_t start_addr, uintptr_t end_addr, size_t requested_size);
+void init_growing_allocator(size_t max_size, size_t requested_size);
+int cy_add_region(void *base, size_t len);
 void *cy_malloc(size_t n);
 void cy_free(void *p);
+void cy_free_sized(void *p, size_t n);
+void *cy_realloc(void *p, size_t n);
+size_t cy_malloc_batch(size_t n, size_t cnt, void **out);
+void cy_free_batch(void **p, size_t cnt);
+void *cy_calloc(size_t cnt, size_t size);
+void *cy_aligned_alloc(size_t align, size_t n);
+void *cy_memalign(size_t align, size_t n);
+int cy_posix_memalign(void **p, size_t align, size_t n);
 void *palloc_get_page(size_t page_cnt);
 void palloc_free_page(void *pages, size_t page_cnt);
+int cy_mallopt(int param, size_t value);
+size_t cy_usable_size(const void *p);
+int cy_size_profile_save(const char *path);
+int cy_size_profile_load(const char *path);
+
+/* Memory taken by the pools, in bytes, from cy_heap_info(). */
+struct cy_heap_info
+{
+  size_t mapped;        /* Readable and writable. */
+  size_t resident;      /* Of MAPPED, allocated, metadata or dirty. */
+  size_t dirty;         /* Of RESIDENT, free but not yet purged. */
+};
+
+size_t cy_heap_trim(void);
+void cy_heap_info(struct cy_heap_info *info);
+
+/* Counters of one size class, from cy_malloc_stats(). */
+struct cy_class_stats
+{
+  size_t size;          /* Block size, or 0 for big blocks. */
+  size_t allocs;        /* Blocks handed out. */
+  size_t frees;         /* Blocks given back. */
+  size_t live;          /* ALLOCS less FREES. */
+  size_t arenas;        /* Arenas with blocks out; big blocks, LIVE. */
+  size_t cached;        /* Empty arenas in the arena cache. */
+  size_t blocks;        /* Blocks ARENAS hold. */
+  size_t free_blocks;   /* Of BLOCKS, in no thread's hands. */
+  size_t refills;       /* Thread cache refills. */
+};
+
+/* Counters of one pool, in pages, from cy_malloc_stats(). */
+struct cy_pool_stats
+{
+  size_t pages;         /* For blocks, not counting metadata. */
+  size_t committed;     /* Of PAGES, readable and writable. */
+  size_t used;          /* Of PAGES, allocated. */
+  size_t dirty;         /* Of PAGES, free but not yet purged. */
+  size_t largest_free;  /* Longest run of free pages. */
+};
+
+#define CY_STATS_CLASSES 102
+#define CY_STATS_POOLS 64
+
+/* Allocator statistics, from cy_malloc_stats(). */
+struct cy_malloc_stats
+{
+  size_t class_cnt;     /* Classes, big blocks last. */
+  struct cy_class_stats classes[CY_STATS_CLASSES];
+  size_t pool_cnt;      /* Pools. */
+  struct cy_pool_stats pools[CY_STATS_POOLS];
+};
+
+/* Formats for cy_malloc_stats_print(). */
+#define CY_STATS_TEXT           0
+#define CY_STATS_JSON           1
+
+void cy_malloc_stats(struct cy_malloc_stats *st);
+int cy_malloc_stats_print(FILE *f, int format);
+
+/* Formats for cy_heap_profile_print(). */
+#define CY_PROF_PPROF           0   /* Legacy pprof heap profile. */
+#define CY_PROF_FOLDED          1   /* Folded stacks for flamegraph.pl. */
+
+int cy_heap_profile_print(FILE *f, int format);
+
+/* Allocation trace, from cy_trace_start().
+
+   The file starts with CY_TRACE_MAGIC, then holds chunks of events
+   of one thread each: the thread's number, the time in ns since the
+   start that the chunk's first event counts from, the length of its
+   events in bytes, and the events.  An event is its type, the ns
+   since the thread's previous event, and its operands below.
+   Numbers are unsigned LEB128 varints, and each address is the
+   zigzag-encoded difference from the chunk's previous address. */
+#define CY_TRACE_MAGIC          "CYTRACE1"
+#define CY_TRACE_MALLOC         0   /* Address, size. */
+#define CY_TRACE_CALLOC         1   /* Address, size. */
+#define CY_TRACE_ALIGNED        2   /* Address, size, alignment. */
+#define CY_TRACE_REALLOC        3   /* Old address, new address, size. */
+#define CY_TRACE_FREE           4   /* Address. */
+
+int cy_trace_start(const char *path);
+int cy_trace_stop(void);
 
 #endif
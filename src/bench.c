@@ -0,0 +1,2408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include "cy_malloc.h"
+#include "cy_bitmap.h"
+#include "cy_buddy.h"
+#include "cy_extent.h"
+#include "cy_vaddr.h"
+
+/* Microbenchmarks for the allocator.
+
+   Usage: ./bench [workload...]
+   Runs every workload when none is named.
+   ./bench replay-file PATH replays a trace from cy_trace_start().
+   ./bench suite-compare OLD NEW compares two saved runs of "suite". */
+
+/* Returns a monotonic timestamp in nanoseconds. */
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns a pseudo-random number, independent of rand()'s state. */
+static unsigned long bench_rand(void)
+{
+  static unsigned long long x = 88172645463325252ull;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return (unsigned long) x;
+}
+
+/* Address space reserved for the allocator's heap. */
+#define POOL_SIZE (1ul << 40)
+
+/* Time init_growing_allocator() took, in nanoseconds. */
+static double pool_init_ns;
+
+/* Initializes the allocator with a growing heap, the first time it
+   is called. */
+static void pool_init(void)
+{
+  static bool done;
+  double t0;
+
+  if (done)
+    return;
+  t0 = now_ns();
+  init_growing_allocator(POOL_SIZE, 0);
+  pool_init_ns = now_ns() - t0;
+  done = true;
+}
+
+/* Returns this process's resident set size in kilobytes. */
+static long rss_kb(void)
+{
+  FILE *f = fopen("/proc/self/statm", "r");
+  long size = 0, resident = 0;
+
+  if (f == NULL)
+    return 0;
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+    resident = 0;
+  fclose(f);
+  return resident * (PGSIZE / 1024);
+}
+
+/* Scans for CNT bits set to VALUE one bit at a time, the way
+   bitmap_scan() did before it worked on whole elements.
+   Kept as the baseline for bench_bitmap(). */
+static size_t ref_scan(const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t bit_cnt = bitmap_size(b);
+  size_t i, j;
+
+  if (cnt > bit_cnt - start)
+    return BITMAP_ERROR;
+  for (i = start; i + cnt <= bit_cnt; i++) {
+    for (j = 0; j < cnt; j++)
+      if (bitmap_test(b, i + j) != value)
+        break;
+    if (j == cnt)
+      return i;
+  }
+  return BITMAP_ERROR;
+}
+
+/* Builds a used_map for a pool of PAGE_CNT pages whose lower 7/8
+   is full except for scattered one- and two-page holes, the shape
+   left behind by long-lived small arenas.  The top 1/8 is free. */
+static struct bitmap *fragmented_map(size_t page_cnt)
+{
+  size_t size = bitmap_buf_size(page_cnt);
+  struct bitmap *b = bitmap_create_in_buf(page_cnt, malloc(size), size);
+  size_t full = page_cnt / 8 * 7;
+  size_t i;
+
+  bitmap_set_multiple(b, 0, full, true);
+  for (i = 0; i < full; i += 1 + bench_rand() % 64)
+    bitmap_set_multiple(b, i, i + 2 <= full ? 1 + bench_rand() % 2 : 1, false);
+  return b;
+}
+
+/* palloc_get_page()/palloc_free_page() on a fragmented pool of
+   1M and 4M pages, with the word-at-a-time scan against the old
+   bit-at-a-time one. */
+static void bench_bitmap(void)
+{
+  static const size_t pool_pages[] = { 1 << 20, 1 << 22 };
+  static const size_t page_cnts[] = { 4, 16, 64 };
+  size_t p, c;
+
+  printf("%-8s %8s %6s %14s %14s %8s\n",
+         "bitmap", "pages", "cnt", "old ns/op", "new ns/op", "speedup");
+  for (p = 0; p < sizeof pool_pages / sizeof *pool_pages; p++) {
+    struct bitmap *b = fragmented_map(pool_pages[p]);
+
+    for (c = 0; c < sizeof page_cnts / sizeof *page_cnts; c++) {
+      size_t cnt = page_cnts[c];
+      int old_iters = 20, new_iters = 2000;
+      double t0, t_old, t_new;
+      size_t idx = 0;
+      int i;
+
+      t0 = now_ns();
+      for (i = 0; i < old_iters; i++) {
+        idx = ref_scan(b, 0, cnt, false);
+        bitmap_set_multiple(b, idx, cnt, true);
+        bitmap_set_multiple(b, idx, cnt, false);
+      }
+      t_old = (now_ns() - t0) / old_iters;
+
+      t0 = now_ns();
+      for (i = 0; i < new_iters; i++) {
+        if (bitmap_scan_and_flip(b, 0, cnt, false) != idx)
+          printf("bitmap: scan mismatch\n");
+        bitmap_set_multiple(b, idx, cnt, false);
+      }
+      t_new = (now_ns() - t0) / new_iters;
+
+      printf("%-8s %8zu %6zu %14.0f %14.0f %7.1fx\n",
+             "", pool_pages[p], cnt, t_old, t_new, t_old / t_new);
+    }
+    free(b);
+  }
+}
+
+/* Allocate/free churn on the used_map of a 4 GB pool (1M pages)
+   whose bottom 3/4 is held by long-lived allocations with a few
+   one-page holes.  Free-page searches use the summary tree; the
+   same operations on an inverted copy of the map, searched for set
+   bits, show the cost of the flat word-at-a-time scan. */
+static void bench_churn(void)
+{
+  enum { PAGES = 1 << 20, LIVE = 4096, OPS = 200000 };
+  static size_t live_idx[LIVE], live_cnt[LIVE];
+  size_t size = bitmap_buf_size(PAGES);
+  struct bitmap *maps[2];
+  double ns[2];
+  int m;
+
+  for (m = 0; m < 2; m++) {
+    bool value = m == 0;
+    struct bitmap *b = bitmap_create_in_buf(PAGES, malloc(size), size);
+    size_t full = PAGES / 4 * 3;
+    size_t i;
+    double t0;
+
+    maps[m] = b;
+    bitmap_set_all(b, !value);
+    bitmap_set_multiple(b, 0, full, value);
+    for (i = 0; i < full; i += 256)
+      bitmap_set(b, i, !value);
+    memset(live_cnt, 0, sizeof live_cnt);
+
+    t0 = now_ns();
+    for (i = 0; i < OPS; i++) {
+      size_t slot = i * 2654435761u % LIVE;
+
+      if (live_cnt[slot] != 0) {
+        bitmap_set_multiple(b, live_idx[slot], live_cnt[slot], !value);
+        live_cnt[slot] = 0;
+      }
+      else {
+        size_t cnt = 1 + i * 40503u % 8;
+
+        live_idx[slot] = bitmap_scan_and_flip(b, 0, cnt, !value);
+        if (live_idx[slot] != BITMAP_ERROR)
+          live_cnt[slot] = cnt;
+      }
+    }
+    ns[m] = (now_ns() - t0) / OPS;
+  }
+
+  printf("%-8s %8s %14s %14s %8s\n",
+         "churn", "pages", "flat ns/op", "summary ns/op", "speedup");
+  printf("%-8s %8d %14.0f %14.0f %7.1fx\n",
+         "", PAGES, ns[1], ns[0], ns[1] / ns[0]);
+  free(maps[0]);
+  free(maps[1]);
+}
+
+/* Serializes cy_malloc()/cy_free() in bench_threads() when it
+   measures callers that wrap the allocator in one global lock. */
+static pthread_mutex_t big_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* One thread of bench_threads(). */
+struct thread_arg
+{
+  pthread_t thread;
+  bool locked;                  /* Take big_lock around each call? */
+  unsigned long seed;           /* Random number state. */
+};
+
+/* Replaces random slots of a small working set with new blocks of
+   16 to 1024 bytes. */
+static void *thread_worker(void *aux)
+{
+  enum { SLOTS = 64, OPS = 200000 };
+  struct thread_arg *arg = aux;
+  void *slots[SLOTS] = { NULL };
+  unsigned long x = arg->seed;
+  int i;
+
+  for (i = 0; i < OPS + SLOTS; i++) {
+    size_t k = i < OPS ? (x >> 8) % SLOTS : (size_t) (i - OPS);
+    size_t n = (size_t) 16 << (x >> 20) % 7;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    if (arg->locked)
+      pthread_mutex_lock(&big_lock);
+    if (slots[k] != NULL)
+      cy_free(slots[k]);
+    slots[k] = i < OPS ? cy_malloc(n) : NULL;
+    if (arg->locked)
+      pthread_mutex_unlock(&big_lock);
+  }
+  return NULL;
+}
+
+/* Runs THREAD_CNT workers and returns their aggregate throughput
+   in millions of operations per second. */
+static double run_threads(int thread_cnt, bool locked)
+{
+  static struct thread_arg args[64];
+  double t0 = now_ns();
+  int i;
+
+  for (i = 0; i < thread_cnt; i++) {
+    args[i].locked = locked;
+    args[i].seed = bench_rand() | 1;
+    pthread_create(&args[i].thread, NULL, thread_worker, &args[i]);
+  }
+  for (i = 0; i < thread_cnt; i++)
+    pthread_join(args[i].thread, NULL);
+  return thread_cnt * 200000 * 2 / ((now_ns() - t0) / 1e3);
+}
+
+/* Multi-threaded small-object throughput from 1 to 64 threads,
+   with per-thread caches and with one global lock around every
+   call. */
+static void bench_threads(void)
+{
+  int thread_cnt;
+
+  pool_init();
+  printf("%-8s %8s %14s %14s\n",
+         "threads", "threads", "cached Mops/s", "locked Mops/s");
+  for (thread_cnt = 1; thread_cnt <= 64; thread_cnt *= 2) {
+    double cached = run_threads(thread_cnt, false);
+    double locked = run_threads(thread_cnt, true);
+
+    printf("%-8s %8d %14.2f %14.2f\n", "", thread_cnt, cached, locked);
+  }
+}
+
+/* Single-producer, single-consumer ring of messages for
+   bench_pc(). */
+#define RING_SIZE 1024
+static void *ring[RING_SIZE];
+static atomic_size_t ring_head, ring_tail;
+
+/* Number of messages passed through the ring per run. */
+#define PC_MSGS 2000000
+
+/* Allocates PC_MSGS messages and passes them to pc_consumer(). */
+static void *pc_producer(void *aux)
+{
+  size_t i;
+
+  for (i = 0; i < PC_MSGS; i++) {
+    size_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    size_t *msg = cy_malloc(64);
+
+    msg[0] = i;
+    while (head - atomic_load_explicit(&ring_tail, memory_order_acquire)
+           == RING_SIZE)
+      sched_yield();
+    ring[head % RING_SIZE] = msg;
+    atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+  }
+  return NULL;
+}
+
+/* Reads and frees PC_MSGS messages from pc_producer(). */
+static void *pc_consumer(void *aux)
+{
+  size_t i;
+
+  for (i = 0; i < PC_MSGS; i++) {
+    size_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    size_t *msg;
+
+    while (atomic_load_explicit(&ring_head, memory_order_acquire) == tail)
+      sched_yield();
+    msg = ring[tail % RING_SIZE];
+    if (msg[0] != i)
+      printf("pc: message out of order\n");
+    cy_free(msg);
+    atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+  }
+  return NULL;
+}
+
+/* Producer/consumer: one thread allocates 64-byte messages and
+   another frees them, so every free is a remote free.  The same
+   messages allocated and freed by one thread give the local cost;
+   the difference is what moving each block (and its cache lines)
+   between threads costs. */
+static void bench_pc(void)
+{
+  static struct cy_malloc_stats st;
+  pthread_t producer, consumer;
+  double t0, pc_ns, local_ns;
+  size_t i, held = 0;
+
+  pool_init();
+
+  t0 = now_ns();
+  for (i = 0; i < PC_MSGS; i++) {
+    size_t *msg = cy_malloc(64);
+
+    msg[0] = i;
+    cy_free(msg);
+  }
+  local_ns = (now_ns() - t0) / PC_MSGS;
+
+  atomic_store(&ring_head, 0);
+  atomic_store(&ring_tail, 0);
+  t0 = now_ns();
+  pthread_create(&producer, NULL, pc_producer, NULL);
+  pthread_create(&consumer, NULL, pc_consumer, NULL);
+  pthread_join(producer, NULL);
+  pthread_join(consumer, NULL);
+  pc_ns = (now_ns() - t0) / PC_MSGS;
+
+  /* Both threads are gone, so cy_heap_trim() must take back every
+     message and release the producer's arenas; only this thread's
+     cache still holds blocks of 64 bytes. */
+  cy_heap_trim();
+  cy_malloc_stats(&st);
+  for (i = 0; i < st.class_cnt; i++)
+    if (st.classes[i].size == 64)
+      held = st.classes[i].arenas;
+
+  printf("%-8s %14s %14s %14s %14s %14s\n",
+         "pc", "frees/s", "pc ns/msg", "local ns/msg", "transfer ns",
+         "arenas held");
+  printf("%-8s %14.0f %14.1f %14.1f %14.1f %14zu\n",
+         "", 1e9 / pc_ns, pc_ns, local_ns, pc_ns - local_ns, held);
+}
+
+/* Allocates the BLOCKS blocks of SIZE bytes in BLOCKS, shuffled.
+   Returns the ns per block. */
+static double free_fill(void **blocks, size_t cnt, size_t size)
+{
+  double t0 = now_ns();
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    blocks[i] = cy_malloc(size);
+  t0 = (now_ns() - t0) / cnt;
+
+  for (i = cnt - 1; i > 0; i--) {
+    size_t j = bench_rand() % (i + 1);
+    void *tmp = blocks[i];
+
+    blocks[i] = blocks[j];
+    blocks[j] = tmp;
+  }
+  return t0;
+}
+
+/* Free-heavy workload: allocates BLOCKS blocks of each size, then
+   frees them in random order, which empties and releases every
+   arena along the way.  Done once with cy_free() and once with
+   cy_free_sized(). */
+static void bench_free(void)
+{
+  enum { BLOCKS = 500000 };
+  static const size_t sizes[] = { 16, 64, 256, 1024 };
+  static void *blocks[BLOCKS];
+  size_t s, i;
+
+  pool_init();
+  printf("%-8s %8s %14s %14s %14s\n", "free", "size", "malloc ns/op",
+         "free ns/op", "sized ns/op");
+  for (s = 0; s < sizeof sizes / sizeof *sizes; s++) {
+    double t0, t_malloc, t_free, t_sized;
+
+    t_malloc = free_fill(blocks, BLOCKS, sizes[s]);
+    t0 = now_ns();
+    for (i = 0; i < BLOCKS; i++)
+      cy_free(blocks[i]);
+    t_free = (now_ns() - t0) / BLOCKS;
+
+    free_fill(blocks, BLOCKS, sizes[s]);
+    t0 = now_ns();
+    for (i = 0; i < BLOCKS; i++)
+      cy_free_sized(blocks[i], sizes[s]);
+    t_sized = (now_ns() - t0) / BLOCKS;
+
+    printf("%-8s %8zu %14.1f %14.1f %14.1f\n", "", sizes[s], t_malloc,
+           t_free, t_sized);
+  }
+
+  /* Hot loop: blocks go back to this thread's cache, never to their
+     arenas, so only finding where a block goes is measured. */
+  printf("%-8s %8s %14s %14s %14s\n", "free-hot", "size", "",
+         "free ns/op", "sized ns/op");
+  for (s = 0; s < sizeof sizes / sizeof *sizes; s++) {
+    enum { HOT = 32, ROUNDS = 100000 };
+    double t0, t_free, t_sized;
+    int round;
+
+    t0 = now_ns();
+    for (round = 0; round < ROUNDS; round++) {
+      for (i = 0; i < HOT; i++)
+        blocks[i] = cy_malloc(sizes[s]);
+      for (i = 0; i < HOT; i++)
+        cy_free(blocks[i]);
+    }
+    t_free = (now_ns() - t0) / ((double) ROUNDS * HOT);
+
+    t0 = now_ns();
+    for (round = 0; round < ROUNDS; round++) {
+      for (i = 0; i < HOT; i++)
+        blocks[i] = cy_malloc(sizes[s]);
+      for (i = 0; i < HOT; i++)
+        cy_free_sized(blocks[i], sizes[s]);
+    }
+    t_sized = (now_ns() - t0) / ((double) ROUNDS * HOT);
+
+    printf("%-8s %8zu %14s %14.1f %14.1f\n", "", sizes[s], "", t_free,
+           t_sized);
+  }
+}
+
+/* Alloc/free ping-pong across a size-class boundary: a burst of
+   blocks a little larger than a thread's cache is allocated and
+   freed over and over, so each round empties arenas and then needs
+   them again.  Run without and with the empty-arena cache. */
+static void bench_pingpong(void)
+{
+  enum { ROUNDS = 20000 };
+  static const size_t sizes[] = { 64, 256, 1024 };
+  static const size_t bursts[] = { 200, 100, 100 };
+  void *blocks[200];
+  size_t s, i;
+  int r, cached;
+
+  pool_init();
+  printf("%-8s %8s %8s %14s %14s\n",
+         "pingpong", "size", "burst", "nocache ns/op", "cache ns/op");
+  for (s = 0; s < sizeof sizes / sizeof *sizes; s++) {
+    double ns[2];
+
+    for (cached = 0; cached < 2; cached++) {
+      double t0;
+
+      cy_mallopt(CY_M_ARENA_CACHE, cached ? 4 : 0);
+      t0 = now_ns();
+      for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < bursts[s]; i++)
+          blocks[i] = cy_malloc(sizes[s]);
+        for (i = 0; i < bursts[s]; i++)
+          cy_free(blocks[i]);
+      }
+      ns[cached] = (now_ns() - t0) / (ROUNDS * bursts[s] * 2);
+    }
+    printf("%-8s %8zu %8zu %14.1f %14.1f\n",
+           "", sizes[s], bursts[s], ns[0], ns[1]);
+  }
+}
+
+/* Returns the number of pages the buddy allocator holds for a
+   request of CNT pages. */
+static size_t buddy_pages(size_t cnt)
+{
+  size_t pages = 1;
+
+  while (pages < cnt)
+    pages *= 2;
+  return pages;
+}
+
+/* Big-block allocator under test: exactly one of the three is set. */
+struct bigblock_palloc
+{
+  struct bitmap *map;
+  struct buddy *buddy;
+  struct extent_index *extents;
+};
+
+/* Allocates CNT pages from P and returns the first page's index,
+   or BITMAP_ERROR. */
+static size_t bigblock_alloc(struct bigblock_palloc *p, size_t cnt)
+{
+  if (p->buddy)
+    return buddy_alloc(p->buddy, cnt);
+  if (p->extents)
+    return extent_alloc(p->extents, cnt);
+  return bitmap_scan_and_flip(p->map, 0, cnt, false);
+}
+
+/* Frees the CNT pages at IDX in P. */
+static void bigblock_free(struct bigblock_palloc *p, size_t idx, size_t cnt)
+{
+  if (p->buddy)
+    buddy_free(p->buddy, idx, cnt);
+  else if (p->extents)
+    extent_free(p->extents, idx, cnt);
+  else
+    bitmap_set_multiple(p->map, idx, cnt, false);
+}
+
+/* Runs a big-block trace against the page allocator PAGE_ALLOC on a
+   pool of PAGE_CNT pages, keeping about half of the pool requested,
+   and prints its latency and fragmentation.  Requests are 2^E to
+   2^(E+1) pages with E uniform in [MIN_EXP, MAX_EXP]. */
+static void bigblock_run(const char *name, int page_alloc, size_t page_cnt,
+                         int min_exp, int max_exp)
+{
+  enum { OPS = 400000, LIVE_MAX = 1 << 16 };
+  static size_t live_idx[LIVE_MAX], live_cnt[LIVE_MAX];
+  size_t size = page_alloc == CY_PALLOC_BUDDY ? buddy_buf_size(page_cnt)
+                : page_alloc == CY_PALLOC_EXTENT ? extent_buf_size(page_cnt)
+                : bitmap_buf_size(page_cnt);
+  void *buf = malloc(size);
+  struct bigblock_palloc p = { NULL, NULL, NULL };
+  size_t requested = 0, held = 0, fails = 0, largest;
+  double alloc_ns = 0, free_ns = 0;
+  size_t allocs = 0, frees = 0;
+  int live = 0, i;
+
+  if (page_alloc == CY_PALLOC_BUDDY)
+    p.buddy = buddy_create_in_buf(page_cnt, buf, size);
+  else if (page_alloc == CY_PALLOC_EXTENT)
+    p.extents = extent_create_in_buf(page_cnt, buf, size);
+  else
+    p.map = bitmap_create_in_buf(page_cnt, buf, size);
+
+  for (i = 0; i < OPS; i++) {
+    double t0;
+
+    if (live < LIVE_MAX && (live == 0 || requested < page_cnt / 2)) {
+      size_t e = min_exp + bench_rand() % (max_exp - min_exp + 1);
+      size_t cnt = ((size_t) 1 << e) + bench_rand() % ((size_t) 1 << e);
+      size_t idx;
+
+      t0 = now_ns();
+      idx = bigblock_alloc(&p, cnt);
+      alloc_ns += now_ns() - t0;
+      allocs++;
+      if (idx == BITMAP_ERROR) {
+        fails++;
+        continue;
+      }
+      live_idx[live] = idx;
+      live_cnt[live++] = cnt;
+      requested += cnt;
+      held += p.buddy ? buddy_pages(cnt) : cnt;
+    }
+    else {
+      int k = bench_rand() % live;
+      size_t cnt = live_cnt[k];
+
+      t0 = now_ns();
+      bigblock_free(&p, live_idx[k], cnt);
+      free_ns += now_ns() - t0;
+      frees++;
+      requested -= cnt;
+      held -= p.buddy ? buddy_pages(cnt) : cnt;
+      live_idx[k] = live_idx[--live];
+      live_cnt[k] = live_cnt[live];
+    }
+  }
+
+  largest = p.buddy ? buddy_largest_free(p.buddy)
+            : p.extents ? extent_largest_free(p.extents)
+            : bitmap_longest_run(p.map);
+  printf("%-8s %8s %10.0f %10.0f %8zu %9.1f%% %9.1f%%\n",
+         "", name, alloc_ns / allocs, free_ns / frees, fails,
+         100.0 * (held - requested) / held,
+         held < page_cnt ? 100.0 - 100.0 * largest / (page_cnt - held) : 0);
+  free(buf);
+}
+
+/* Big-block fragmentation and latency: the first-fit bitmap, the
+   buddy allocator and the best-fit extent index on the same traces,
+   a mixed 8 KB - 4 MB one and a 4 KB - 64 KB one.  "waste" is pages
+   held beyond those requested (buddy rounding); "frag" is the share
+   of free pages outside the largest free run. */
+static void bench_bigblock(void)
+{
+  static const char *names[] = { "bitmap", "buddy", "extent" };
+  static const int modes[] = { CY_PALLOC_BITMAP, CY_PALLOC_BUDDY, CY_PALLOC_EXTENT };
+  size_t m;
+
+  printf("%-8s %8s %10s %10s %8s %10s %10s\n", "bigblock", "palloc",
+         "alloc ns", "free ns", "fails", "waste", "frag");
+  printf("8 KB - 4 MB\n");
+  for (m = 0; m < 3; m++)
+    bigblock_run(names[m], modes[m], 1 << 20, 1, 9);
+  printf("4 KB - 64 KB\n");
+  for (m = 0; m < 3; m++)
+    bigblock_run(names[m], modes[m], 1 << 18, 0, 3);
+}
+
+/* Startup and growth of the heap: how long reserving POOL_SIZE
+   bytes took, then the cost of handing out 256 MB as 64 KB blocks,
+   committing pages on the way, and what that leaves resident.
+   Last, the heap must grow past BIG_TOTAL in BIG_BLOCK blocks that
+   are never touched, which takes far more address space than
+   POOL_MAX pools of a single chunk have. */
+static void bench_grow(void)
+{
+  enum { BLOCK = 64 << 10, CNT = (256 << 20) / BLOCK };
+  enum { BIG_BLOCK = 768 << 20, BIG_CNT = 100 };
+  static void *blocks[CNT], *big[BIG_CNT];
+  struct cy_heap_info info;
+  long rss0;
+  double t0, ns;
+  int i;
+
+  pool_init();
+  rss0 = rss_kb();
+  t0 = now_ns();
+  for (i = 0; i < CNT; i++) {
+    blocks[i] = cy_malloc(BLOCK);
+    if (blocks[i] == NULL) {
+      printf("[ERROR] out of memory\n");
+      exit(1);
+    }
+    memset(blocks[i], 0, BLOCK);
+  }
+  ns = (now_ns() - t0) / CNT;
+  printf("%-8s %12s %12s %14s %12s\n", "grow", "reserve GB", "init us",
+         "alloc+touch ns", "rss MB");
+  printf("%-8s %12lu %12.1f %14.0f %12ld\n", "", POOL_SIZE >> 30,
+         pool_init_ns / 1e3, ns, (rss_kb() - rss0) >> 10);
+  for (i = 0; i < CNT; i++)
+    cy_free(blocks[i]);
+
+  rss0 = rss_kb();
+  for (i = 0; i < BIG_CNT; i++)
+    if ((big[i] = cy_malloc(BIG_BLOCK)) == NULL)
+      break;
+  cy_heap_info(&info);
+  printf("%-8s %12s %12s %14s %12s\n", "", "blocks", "GB", "mapped GB",
+         "rss MB");
+  printf("%-8s %12d %12lu %14zu %12ld\n", "", i,
+         (unsigned long) i * BIG_BLOCK >> 30, info.mapped >> 30,
+         (rss_kb() - rss0) >> 10);
+  if (i < BIG_CNT) {
+    printf("[ERROR] the heap stopped growing at %d blocks of %d MB\n", i,
+           BIG_BLOCK >> 20);
+    exit(1);
+  }
+  for (i = 0; i < BIG_CNT; i++)
+    cy_free(big[i]);
+}
+
+/* Allocates and touches 256 MB as 64 KB blocks, then frees them,
+   and prints the process's RSS next to what cy_heap_info()
+   reports.  Returns the nanoseconds the frees took. */
+static double purge_spike(const char *label)
+{
+  enum { BLOCK = 64 << 10, CNT = (256 << 20) / BLOCK };
+  static void *blocks[CNT];
+  struct cy_heap_info info;
+  double t0;
+  int i;
+
+  for (i = 0; i < CNT; i++) {
+    blocks[i] = cy_malloc(BLOCK);
+    if (blocks[i] == NULL) {
+      printf("[ERROR] out of memory\n");
+      exit(1);
+    }
+    memset(blocks[i], 1, BLOCK);
+  }
+  cy_heap_info(&info);
+  printf("%-8s %-14s %10ld %10zu %10zu %10zu\n", "", "spike", rss_kb() >> 10,
+         info.mapped >> 20, info.resident >> 20, info.dirty >> 20);
+  t0 = now_ns();
+  for (i = 0; i < CNT; i++)
+    cy_free(blocks[i]);
+  t0 = now_ns() - t0;
+  cy_heap_info(&info);
+  printf("%-8s %-14s %10ld %10zu %10zu %10zu\n", "", label, rss_kb() >> 10,
+         info.mapped >> 20, info.resident >> 20, info.dirty >> 20);
+  return t0 / CNT;
+}
+
+/* Returning memory after a traffic spike: with the default decay,
+   with cy_heap_trim(), with the background thread and a 100 ms
+   decay, and with immediate purging on free.  Sizes are in MB. */
+static void bench_purge(void)
+{
+  struct cy_heap_info info;
+  double kept_ns, eager_ns;
+
+  pool_init();
+  printf("%-8s %-14s %10s %10s %10s %10s\n", "purge", "after",
+         "rss", "mapped", "resident", "dirty");
+  kept_ns = purge_spike("free");
+  cy_heap_trim();
+  cy_heap_info(&info);
+  printf("%-8s %-14s %10ld %10zu %10zu %10zu\n", "", "cy_heap_trim",
+         rss_kb() >> 10, info.mapped >> 20, info.resident >> 20,
+         info.dirty >> 20);
+
+  cy_mallopt(CY_M_PURGE_DECAY, 100);
+  cy_mallopt(CY_M_PURGE_THREAD, 1);
+  purge_spike("free");
+  usleep(300 * 1000);
+  cy_heap_info(&info);
+  printf("%-8s %-14s %10ld %10zu %10zu %10zu\n", "", "300 ms, thread",
+         rss_kb() >> 10, info.mapped >> 20, info.resident >> 20,
+         info.dirty >> 20);
+  cy_mallopt(CY_M_PURGE_THREAD, 0);
+
+  cy_mallopt(CY_M_PURGE_DECAY, 0);
+  eager_ns = purge_spike("free, decay 0");
+  cy_mallopt(CY_M_PURGE_DECAY, 10000);
+  printf("%-8s free ns per 64 KB block: %.0f kept, %.0f purged\n", "",
+         kept_ns, eager_ns);
+}
+
+/* Grows BUFS buffers side by side from nothing to 1 MB in 1 KB
+   appends, with cy_realloc() if USE_REALLOC or else with
+   cy_malloc(), memcpy() and cy_free().  Returns the ns per append
+   and stores the number of times a buffer moved in *MOVES. */
+static double realloc_run(int bufs, bool use_realloc, size_t *moves)
+{
+  enum { STEP = 1 << 10, MAX = 1 << 20, ROUNDS = 20 };
+  char *buf[8] = { NULL };
+  size_t len = 0;
+  double t0 = now_ns();
+  int round, i;
+
+  *moves = 0;
+  for (round = 0; round < ROUNDS; round++) {
+    for (len = STEP; len <= MAX; len += STEP)
+      for (i = 0; i < bufs; i++) {
+        char *q;
+
+        if (use_realloc)
+          q = cy_realloc(buf[i], len);
+        else {
+          q = cy_malloc(len);
+          if (q != NULL && buf[i] != NULL) {
+            memcpy(q, buf[i], len - STEP);
+            cy_free(buf[i]);
+          }
+        }
+        if (q == NULL) {
+          printf("[ERROR] out of memory\n");
+          exit(1);
+        }
+        *moves += q != buf[i];
+        memset(q + len - STEP, i, STEP);
+        buf[i] = q;
+      }
+    for (i = 0; i < bufs; i++) {
+      cy_free(buf[i]);
+      buf[i] = NULL;
+    }
+  }
+  *moves /= ROUNDS;
+  return (now_ns() - t0) / ((double) ROUNDS * bufs * (MAX / STEP));
+}
+
+/* Append-heavy buffers: one buffer, which can always grow in place,
+   and four growing side by side, which get in each other's way. */
+static void bench_realloc(void)
+{
+  int bufs;
+
+  pool_init();
+  printf("%-8s %8s %14s %10s %14s %10s\n", "realloc", "buffers",
+         "realloc ns/op", "moves", "copy ns/op", "moves");
+  for (bufs = 1; bufs <= 4; bufs *= 4) {
+    size_t realloc_moves, copy_moves;
+    double realloc_ns = realloc_run(bufs, true, &realloc_moves);
+    double copy_ns = realloc_run(bufs, false, &copy_moves);
+
+    printf("%-8s %8d %14.1f %10zu %14.1f %10zu\n", "", bufs,
+           realloc_ns, realloc_moves, copy_ns, copy_moves);
+  }
+}
+
+/* Obtains ROUNDS blocks of SIZE zeroed bytes, with cy_calloc() if
+   USE_CALLOC or else with cy_malloc() and memset(), writing the
+   first byte of each page as a caller would, and frees each one
+   before the next unless KEEP.  Returns the ns per block. */
+static double calloc_run(size_t size, bool use_calloc, bool keep)
+{
+  enum { ROUNDS = 64 };
+  char *p[ROUNDS];
+  double t0 = now_ns();
+  size_t ofs;
+  int i;
+
+  for (i = 0; i < ROUNDS; i++) {
+    if (use_calloc)
+      p[i] = cy_calloc(1, size);
+    else if ((p[i] = cy_malloc(size)) != NULL)
+      memset(p[i], 0, size);
+    if (p[i] == NULL) {
+      printf("[ERROR] out of memory\n");
+      exit(1);
+    }
+    for (ofs = 0; ofs < size; ofs += PGSIZE)
+      p[i][ofs] = 1;
+    if (!keep)
+      cy_free(p[i]);
+  }
+  t0 = (now_ns() - t0) / ROUNDS;
+  if (keep)
+    for (i = 0; i < ROUNDS; i++)
+      cy_free(p[i]);
+  return t0;
+}
+
+/* Zeroed big blocks: fresh pages each time, which cy_calloc() need
+   not clear, and the same dirty pages each time, which it must. */
+static void bench_calloc(void)
+{
+  size_t size;
+
+  /* Touch the heap once, so that neither side pays for the first
+     faults on memory the process never had. */
+  pool_init();
+  calloc_run(4 << 20, false, true);
+  cy_heap_trim();
+  printf("%-8s %8s %14s %14s %14s %14s\n", "calloc", "KB",
+         "fresh calloc", "fresh memset", "reuse calloc", "reuse memset");
+  for (size = 64 << 10; size <= (4 << 20); size *= 4) {
+    double fresh_calloc, fresh_memset;
+
+    /* Purge between runs so that both start from fresh pages. */
+    fresh_calloc = calloc_run(size, true, true);
+    cy_heap_trim();
+    fresh_memset = calloc_run(size, false, true);
+    cy_heap_trim();
+    printf("%-8s %8zu %14.0f %14.0f %14.0f %14.0f\n", "", size >> 10,
+           fresh_calloc, fresh_memset, calloc_run(size, true, false),
+           calloc_run(size, false, false));
+    cy_heap_trim();
+  }
+}
+
+/* Allocates and frees ROUNDS blocks of SIZE bytes aligned to ALIGN,
+   with cy_aligned_alloc() if NATIVE or else by over-allocating with
+   cy_malloc() and rounding up.  Returns the ns per block and stores
+   the memory they took while all held, in KB, in *KB. */
+static double aligned_run(size_t align, size_t size, bool native, long *kb)
+{
+  enum { ROUNDS = 4096 };
+  static void *p[ROUNDS];
+  struct cy_heap_info before, after;
+  double t0;
+  int i;
+
+  cy_heap_info(&before);
+  t0 = now_ns();
+  for (i = 0; i < ROUNDS; i++) {
+    char *q = native ? cy_aligned_alloc(align, size)
+                     : cy_malloc(size + align - 1);
+
+    if (q == NULL) {
+      printf("[ERROR] out of memory\n");
+      exit(1);
+    }
+    p[i] = q;
+    q[-(uintptr_t) q & (align - 1)] = 1;
+  }
+  cy_heap_info(&after);
+  *kb = (long) ((after.resident - after.dirty)
+                - (before.resident - before.dirty)) / 1024;
+  for (i = 0; i < ROUNDS; i++)
+    cy_free(p[i]);
+  return (now_ns() - t0) / ROUNDS;
+}
+/* Aligned blocks: cache-line aligned small ones and page-aligned big
+   ones, natively and by over-allocating.  Each run is done once
+   beforehand, so that neither side pays for the first faults. */
+static void bench_aligned(void)
+{
+  static const struct { size_t align, size; } runs[] =
+    { { 64, 48 }, { 64, 200 }, { PGSIZE, 8192 }, { PGSIZE, 64 << 10 } };
+  size_t i;
+
+  pool_init();
+  printf("%-8s %8s %8s %14s %10s %14s %10s\n", "aligned", "align", "size",
+         "native ns/op", "KB", "manual ns/op", "KB");
+  for (i = 0; i < sizeof runs / sizeof *runs; i++) {
+    long native_kb, manual_kb;
+    double native_ns, manual_ns;
+
+    aligned_run(runs[i].align, runs[i].size, true, &native_kb);
+    aligned_run(runs[i].align, runs[i].size, false, &manual_kb);
+    native_ns = aligned_run(runs[i].align, runs[i].size, true, &native_kb);
+    manual_ns = aligned_run(runs[i].align, runs[i].size, false, &manual_kb);
+    printf("%-8s %8zu %8zu %14.1f %10ld %14.1f %10ld\n", "", runs[i].align,
+           runs[i].size, native_ns, native_kb, manual_ns, manual_kb);
+  }
+}
+
+/* Heap density: how much of the heap's memory the blocks use when
+   many of one size are held at once.  Each size is of a class of
+   its own, and the heap exists before the first is measured. */
+static void bench_density(void)
+{
+  enum { CNT = 4096 };
+  static const size_t sizes[] = { 24, 48, 200, 1000, 2000, 3000 };
+  static void *p[CNT];
+  size_t i;
+  int j;
+
+  pool_init();
+  cy_free(cy_malloc(1));
+  cy_heap_trim();
+  printf("%-8s %8s %12s %10s\n", "density", "size", "heap KB", "used");
+  for (i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+    struct cy_heap_info before, after;
+    size_t used;
+
+    cy_heap_info(&before);
+    for (j = 0; j < CNT; j++)
+      if ((p[j] = cy_malloc(sizes[i])) == NULL) {
+        printf("[ERROR] out of memory\n");
+        exit(1);
+      }
+    cy_heap_info(&after);
+    used = (after.resident - after.dirty) - (before.resident - before.dirty);
+    printf("%-8s %8zu %12zu %9.1f%%\n", "", sizes[i], used / 1024,
+           100.0 * sizes[i] * CNT / used);
+    for (j = 0; j < CNT; j++)
+      cy_free(p[j]);
+    cy_heap_trim();
+  }
+}
+
+/* Allocates and frees CNT blocks of SIZE bytes together, ROUNDS
+   times, with cy_malloc_batch() and cy_free_batch() if BATCH or one
+   at a time otherwise.  Returns the ns per block. */
+static double batch_run(size_t size, size_t cnt, bool batch)
+{
+  enum { ROUNDS = 20000 };
+  static void *p[256];
+  double t0 = now_ns();
+  size_t i;
+  int round;
+
+  for (round = 0; round < ROUNDS; round++) {
+    if (batch) {
+      if (cy_malloc_batch(size, cnt, p) != cnt) {
+        printf("[ERROR] out of memory\n");
+        exit(1);
+      }
+      cy_free_batch(p, cnt);
+    }
+    else {
+      for (i = 0; i < cnt; i++)
+        if ((p[i] = cy_malloc(size)) == NULL) {
+          printf("[ERROR] out of memory\n");
+          exit(1);
+        }
+      for (i = 0; i < cnt; i++)
+        cy_free(p[i]);
+    }
+  }
+  return (now_ns() - t0) / ((double) ROUNDS * cnt);
+}
+
+/* Request-parser style: dozens of same-size nodes allocated at once
+   and freed together. */
+static void bench_batch(void)
+{
+  static const size_t sizes[] = { 48, 200 };
+  static const size_t cnts[] = { 16, 64, 256 };
+  size_t i, j;
+
+  pool_init();
+  printf("%-8s %8s %8s %14s %14s\n", "batch", "size", "blocks",
+         "single ns/op", "batch ns/op");
+  for (i = 0; i < sizeof sizes / sizeof *sizes; i++)
+    for (j = 0; j < sizeof cnts / sizeof *cnts; j++) {
+      double single_ns = batch_run(sizes[i], cnts[j], false);
+      double batch_ns = batch_run(sizes[i], cnts[j], true);
+
+      printf("%-8s %8zu %8zu %14.1f %14.1f\n", "", sizes[i], cnts[j],
+             single_ns, batch_ns);
+    }
+}
+
+/* File the classes workload keeps its size profile in. */
+#define CLASSES_PROFILE "/tmp/cy_bench_profile.txt"
+
+/* Returns the size of the next request of a recorded parser-like
+   trace: a few hot node sizes, which fall between power-of-two
+   classes, over a spread of everything else. */
+static size_t classes_size(void)
+{
+  static const size_t hot[] = { 24, 40, 72, 136, 260, 600, 1100 };
+  unsigned long r = bench_rand() % 100;
+
+  if (r < 70)
+    return hot[r % (sizeof hot / sizeof *hot)];
+  return 1 + bench_rand() % 2048;
+}
+
+/* One run of bench_classes(), in a process of its own since classes
+   are laid out at init: replays the trace with LAYOUT's classes and
+   reports how much of the memory it takes goes to waste.  LAYOUT
+   "pow2" also records the trace's size profile, which "profile"
+   then loads. */
+static void classes_run(const char *layout)
+{
+  enum { CNT = 200000 };
+  static void *p[CNT];
+  struct cy_heap_info before, after;
+  size_t asked = 0, usable = 0, used, i;
+
+  if (strcmp(layout, "pow2") != 0)
+    cy_mallopt(CY_M_SIZE_CLASSES, CY_CLASSES_QUARTER);
+  if (!strcmp(layout, "profile") && !cy_size_profile_load(CLASSES_PROFILE))
+    return;
+  if (!strcmp(layout, "pow2"))
+    cy_mallopt(CY_M_SIZE_SAMPLE, 16);
+  pool_init();
+  cy_free(cy_malloc(1));
+
+  cy_heap_info(&before);
+  for (i = 0; i < CNT; i++) {
+    size_t n = classes_size();
+
+    if ((p[i] = cy_malloc(n)) == NULL) {
+      printf("[ERROR] out of memory\n");
+      exit(1);
+    }
+    asked += n;
+    usable += cy_usable_size(p[i]);
+  }
+  cy_heap_info(&after);
+  used = (after.resident - after.dirty) - (before.resident - before.dirty);
+  printf("%-8s %8s %12zu %12zu %10.1f%% %10.1f%%\n", "", layout,
+         asked >> 10, used >> 10, 100.0 * (usable - asked) / usable,
+         100.0 * (used - asked) / used);
+  if (!strcmp(layout, "pow2"))
+    cy_size_profile_save(CLASSES_PROFILE);
+}
+
+/* Size classes: a recorded trace replayed with power-of-two classes,
+   four per doubling, and four per doubling plus the hot sizes of
+   the trace's profile.  Internal is the share of the blocks that
+   the requests do not use; heap, the share of the heap's pages. */
+static void bench_classes(void)
+{
+  static const char *const layouts[] = { "pow2", "quarter", "profile" };
+  size_t i;
+
+  printf("%-8s %8s %12s %12s %11s %11s\n", "classes", "layout",
+         "asked KB", "heap KB", "internal", "heap");
+  fflush(stdout);
+  for (i = 0; i < sizeof layouts / sizeof *layouts; i++) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+      execl("/proc/self/exe", "bench", "classes-run", layouts[i],
+            (char *) NULL);
+      _exit(1);
+    }
+    if (pid > 0)
+      waitpid(pid, NULL, 0);
+  }
+  remove(CLASSES_PROFILE);
+}
+
+/* Trace file that bench_replay() records and replays. */
+#define REPLAY_TRACE "/tmp/cy_bench_trace.bin"
+
+/* An event of a trace, in the order replay_run() performs them.
+   Blocks are numbered in the order they are obtained, so that the
+   replay looks them up in an array rather than by address. */
+struct replay_op
+{
+  uint8_t op;                   /* CY_TRACE_*. */
+  uint32_t id;                  /* Block obtained. */
+  uint32_t old;                 /* Block given back, or REPLAY_NONE. */
+  size_t size;                  /* Bytes asked for. */
+  size_t align;                 /* Alignment, for CY_TRACE_ALIGNED. */
+};
+
+#define REPLAY_NONE UINT32_MAX
+
+/* A trace, loaded by replay_load(). */
+struct replay
+{
+  struct replay_op *ops;        /* Events. */
+  size_t op_cnt;                /* Number of OPS. */
+  size_t block_cnt;             /* Blocks numbered. */
+  unsigned thread_cnt;          /* Threads that recorded events. */
+  size_t unmatched;             /* Frees of blocks not in the trace. */
+  size_t peak_bytes;            /* Most bytes asked for at once. */
+};
+
+/* An event as decoded from a trace file. */
+struct replay_event
+{
+  uint64_t time;                /* Ns since the trace started. */
+  size_t seq;                   /* Position in the file. */
+  uint8_t op;                   /* CY_TRACE_*. */
+  uintptr_t old, new;           /* Addresses. */
+  size_t size, align;           /* Operands. */
+};
+
+/* Reads an unsigned LEB128 varint from *P, before END, and advances
+   *P past it.  Returns false if the varint runs past END. */
+static bool replay_varint(const uint8_t **p, const uint8_t *end, uint64_t *x)
+{
+  int shift;
+
+  *x = 0;
+  for (shift = 0; *p < end && shift < 64; shift += 7) {
+    uint8_t byte = *(*p)++;
+
+    *x |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+/* Reads an address, stored as the zigzag difference from *LAST, from
+   *P before END and advances *P past it. */
+static bool replay_addr(const uint8_t **p, const uint8_t *end,
+                        uintptr_t *last, uintptr_t *addr)
+{
+  uint64_t z;
+
+  if (!replay_varint(p, end, &z))
+    return false;
+  *last += (uintptr_t) (z >> 1 ^ -(z & 1));
+  *addr = *last;
+  return true;
+}
+
+/* Orders events by time, then by position in the file, which keeps
+   each thread's events in the order it recorded them. */
+static int replay_event_cmp(const void *a_, const void *b_)
+{
+  const struct replay_event *a = a_, *b = b_;
+
+  if (a->time != b->time)
+    return a->time < b->time ? -1 : 1;
+  return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/* Block numbers of the live addresses of a trace, by open
+   addressing. */
+struct replay_map
+{
+  uintptr_t *addr;              /* Address, 0 if the slot is free. */
+  uint32_t *id;                 /* Block number. */
+  size_t mask;                  /* Slots less one. */
+};
+
+/* Returns the slot of ADDR in M, or the free slot where it goes. */
+static size_t replay_map_slot(struct replay_map *m, uintptr_t addr)
+{
+  size_t i = (addr >> 4) * 0x9e3779b97f4a7c15ull >> 20 & m->mask;
+
+  while (m->addr[i] != 0 && m->addr[i] != addr)
+    i = (i + 1) & m->mask;
+  return i;
+}
+
+/* Removes ADDR from M and returns its block number, or REPLAY_NONE
+   if it is not there. */
+static uint32_t replay_map_take(struct replay_map *m, uintptr_t addr)
+{
+  size_t i = replay_map_slot(m, addr), j;
+  uint32_t id;
+
+  if (addr == 0 || m->addr[i] == 0)
+    return REPLAY_NONE;
+  id = m->id[i];
+
+  /* Move later entries of the run up into the hole. */
+  m->addr[i] = 0;
+  for (j = (i + 1) & m->mask; m->addr[j] != 0; j = (j + 1) & m->mask) {
+    size_t k = replay_map_slot(m, m->addr[j]);
+
+    if (k != j) {
+      m->addr[k] = m->addr[j];
+      m->id[k] = m->id[j];
+      m->addr[j] = 0;
+    }
+  }
+  return id;
+}
+
+/* Loads the trace at PATH into R, ordering the events of every
+   thread by time and numbering the blocks.  Returns false if the
+   file cannot be read or is not a trace. */
+static bool replay_load(const char *path, struct replay *r)
+{
+  struct replay_event *ev = NULL;
+  struct replay_map map;
+  size_t ev_cnt = 0, ev_max = 0, len, i, live = 0;
+  size_t *sizes;
+  uint8_t *buf;
+  const uint8_t *p, *end;
+  FILE *f = fopen(path, "rb");
+
+  memset(r, 0, sizeof *r);
+  if (f == NULL) {
+    printf("[ERROR] cannot read %s\n", path);
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  rewind(f);
+  buf = malloc(len);
+  if (buf == NULL || fread(buf, 1, len, f) != len
+      || len < sizeof CY_TRACE_MAGIC - 1
+      || memcmp(buf, CY_TRACE_MAGIC, sizeof CY_TRACE_MAGIC - 1) != 0) {
+    printf("[ERROR] %s is not a trace\n", path);
+    fclose(f);
+    free(buf);
+    return false;
+  }
+  fclose(f);
+
+  /* Decode every chunk. */
+  p = buf + sizeof CY_TRACE_MAGIC - 1;
+  end = buf + len;
+  while (p < end) {
+    uint64_t thread, time, chunk_len;
+    const uint8_t *chunk_end;
+    uintptr_t last = 0;
+
+    if (!replay_varint(&p, end, &thread) || !replay_varint(&p, end, &time)
+        || !replay_varint(&p, end, &chunk_len)
+        || chunk_len > (size_t) (end - p))
+      break;
+    if (thread > r->thread_cnt)
+      r->thread_cnt = thread;
+    for (chunk_end = p + chunk_len; p < chunk_end; ) {
+      struct replay_event *e;
+      uint64_t dt, x = 0, a = 0;
+      bool ok;
+
+      if (ev_cnt == ev_max) {
+        ev_max = ev_max ? 2 * ev_max : 1 << 16;
+        ev = realloc(ev, ev_max * sizeof *ev);
+      }
+      e = &ev[ev_cnt];
+      e->op = *p++;
+      e->seq = ev_cnt;
+      e->old = e->new = 0;
+      ok = replay_varint(&p, chunk_end, &dt);
+      time += dt;
+      e->time = time;
+      if (e->op == CY_TRACE_REALLOC || e->op == CY_TRACE_FREE)
+        ok = ok && replay_addr(&p, chunk_end, &last, &e->old);
+      if (e->op != CY_TRACE_FREE)
+        ok = ok && replay_addr(&p, chunk_end, &last, &e->new)
+             && replay_varint(&p, chunk_end, &x);
+      if (e->op == CY_TRACE_ALIGNED)
+        ok = ok && replay_varint(&p, chunk_end, &a);
+      if (!ok || e->op > CY_TRACE_FREE)
+        break;
+      e->size = x;
+      e->align = a;
+      ev_cnt++;
+    }
+    p = chunk_end;
+  }
+  free(buf);
+  qsort(ev, ev_cnt, sizeof *ev, replay_event_cmp);
+
+  /* Number the blocks. */
+  for (map.mask = 1023; map.mask < 2 * ev_cnt; map.mask = 2 * map.mask + 1)
+    continue;
+  map.addr = calloc(map.mask + 1, sizeof *map.addr);
+  map.id = malloc((map.mask + 1) * sizeof *map.id);
+  sizes = malloc((ev_cnt + 1) * sizeof *sizes);
+  r->ops = malloc((ev_cnt + 1) * sizeof *r->ops);
+  for (i = 0; i < ev_cnt; i++) {
+    struct replay_event *e = &ev[i];
+    struct replay_op *op = &r->ops[r->op_cnt];
+
+    op->op = e->op;
+    op->size = e->size;
+    op->align = e->align;
+    op->old = REPLAY_NONE;
+    if (e->op == CY_TRACE_REALLOC || e->op == CY_TRACE_FREE) {
+      op->old = replay_map_take(&map, e->old);
+      if (op->old == REPLAY_NONE)
+        r->unmatched++;
+      else
+        live -= sizes[op->old];
+      if (e->op == CY_TRACE_FREE && op->old == REPLAY_NONE)
+        continue;
+    }
+    if (e->op != CY_TRACE_FREE) {
+      size_t k;
+
+      /* An address still live was freed by another thread at the
+         same time; that block stays out of the replay. */
+      replay_map_take(&map, e->new);
+      k = replay_map_slot(&map, e->new);
+      op->id = r->block_cnt++;
+      map.addr[k] = e->new;
+      map.id[k] = op->id;
+      sizes[op->id] = e->size;
+      live += e->size;
+      if (live > r->peak_bytes)
+        r->peak_bytes = live;
+    }
+    r->op_cnt++;
+  }
+  free(map.addr);
+  free(map.id);
+  free(sizes);
+  free(ev);
+  return true;
+}
+
+/* An allocator that bench_replay() and bench_suite() compare. */
+struct bench_alloc
+{
+  const char *name;
+  void *(*malloc) (size_t);
+  void *(*calloc) (size_t, size_t);
+  void *(*aligned_alloc) (size_t, size_t);
+  void *(*realloc) (void *, size_t);
+  void (*free) (void *);
+};
+
+static const struct bench_alloc bench_allocs[] =
+{
+  { "cy", cy_malloc, cy_calloc, cy_aligned_alloc, cy_realloc, cy_free },
+  { "glibc", malloc, calloc, aligned_alloc, realloc, free },
+};
+
+/* Writes a byte to every page of the N bytes at P. */
+static inline void replay_touch(void *p, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i += PGSIZE)
+    ((volatile char *) p)[i] = 0;
+}
+
+/* Performs OP with A on BLOCKS, writing to every page of the block
+   it obtains, as its caller would. */
+static inline void replay_step(const struct bench_alloc *a,
+                               const struct replay_op *op, void **blocks)
+{
+  void *p = NULL;
+
+  switch (op->op) {
+    case CY_TRACE_MALLOC:
+      p = a->malloc(op->size);
+      break;
+    case CY_TRACE_CALLOC:
+      p = a->calloc(1, op->size);
+      break;
+    case CY_TRACE_ALIGNED:
+      p = a->aligned_alloc(op->align, op->size);
+      break;
+    case CY_TRACE_REALLOC:
+      p = a->realloc(op->old != REPLAY_NONE ? blocks[op->old] : NULL,
+                     op->size);
+      if (op->old != REPLAY_NONE)
+        blocks[op->old] = NULL;
+      break;
+    case CY_TRACE_FREE:
+      if (blocks[op->old] != NULL)
+        a->free(blocks[op->old]);
+      blocks[op->old] = NULL;
+      return;
+  }
+  blocks[op->id] = p;
+  if (p != NULL)
+    replay_touch(p, op->size);
+}
+
+/* Returns this process's peak resident set size in kilobytes since
+   it was last reset with reset_peak_rss(). */
+static long peak_rss_kb(void)
+{
+  FILE *f = fopen("/proc/self/status", "r");
+  char line[128];
+  long kb = 0;
+
+  if (f == NULL)
+    return 0;
+  while (fgets(line, sizeof line, f) != NULL)
+    if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+      break;
+  fclose(f);
+  return kb;
+}
+
+/* Resets the peak that peak_rss_kb() reports to the current RSS. */
+static void reset_peak_rss(void)
+{
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+
+  if (f != NULL) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+static int replay_lat_cmp(const void *a_, const void *b_)
+{
+  float a = *(const float *) a_, b = *(const float *) b_;
+
+  return (a > b) - (a < b);
+}
+
+/* One run of bench_replay(), in a process of its own so that its
+   footprint is the allocator's alone: replays the trace at PATH
+   against allocator NAME once straight through, for throughput and
+   peak footprint, and once timing every event, for latency. */
+static void replay_run(const char *name, const char *path)
+{
+  const struct bench_alloc *a = NULL;
+  struct replay r;
+  void **blocks;
+  float *lat;
+  double t0, secs;
+  long rss0, peak;
+  size_t i;
+
+  for (i = 0; i < sizeof bench_allocs / sizeof *bench_allocs; i++)
+    if (!strcmp(name, bench_allocs[i].name))
+      a = &bench_allocs[i];
+  if (a == NULL || !replay_load(path, &r))
+    return;
+  blocks = calloc(r.block_cnt + 1, sizeof *blocks);
+  lat = malloc((r.op_cnt + 1) * sizeof *lat);
+  replay_touch(blocks, (r.block_cnt + 1) * sizeof *blocks);
+  replay_touch(lat, (r.op_cnt + 1) * sizeof *lat);
+  if (a->malloc == cy_malloc) {
+    pool_init();
+    cy_free(cy_malloc(1));
+  }
+#ifdef __GLIBC__
+  /* Do not let glibc reuse what loading the trace left resident. */
+  malloc_trim(0);
+#endif
+
+  reset_peak_rss();
+  rss0 = rss_kb();
+  t0 = now_ns();
+  for (i = 0; i < r.op_cnt; i++)
+    replay_step(a, &r.ops[i], blocks);
+  secs = (now_ns() - t0) / 1e9;
+  peak = peak_rss_kb() - rss0;
+  for (i = 0; i < r.block_cnt; i++)
+    if (blocks[i] != NULL) {
+      a->free(blocks[i]);
+      blocks[i] = NULL;
+    }
+
+  for (i = 0; i < r.op_cnt; i++) {
+    t0 = now_ns();
+    replay_step(a, &r.ops[i], blocks);
+    lat[i] = now_ns() - t0;
+  }
+  qsort(lat, r.op_cnt, sizeof *lat, replay_lat_cmp);
+  printf("%-8s %8s %10.2f %8.0f %8.0f %8.0f %10ld %10zu\n", "", a->name,
+         r.op_cnt / secs / 1e6, lat[r.op_cnt / 2], lat[r.op_cnt * 99 / 100],
+         lat[r.op_cnt * 999 / 1000], peak, r.peak_bytes >> 10);
+}
+
+/* Replays the trace at PATH against every allocator, each in a
+   process of its own.  Returns the number of frees in the trace of
+   blocks it does not allocate, or SIZE_MAX if it cannot be read. */
+static size_t replay_file(const char *path)
+{
+  struct replay r;
+  size_t i;
+
+  if (!replay_load(path, &r))
+    return SIZE_MAX;
+  printf("%-8s %zu events, %zu blocks, %u threads, %zu unmatched frees\n",
+         "replay", r.op_cnt, r.block_cnt, r.thread_cnt, r.unmatched);
+  free(r.ops);
+  printf("%-8s %8s %10s %8s %8s %8s %10s %10s\n", "replay", "alloc",
+         "Mops/s", "p50 ns", "p99 ns", "p999 ns", "peak KB", "live KB");
+  fflush(stdout);
+  for (i = 0; i < sizeof bench_allocs / sizeof *bench_allocs; i++) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+      execl("/proc/self/exe", "bench", "replay-run", bench_allocs[i].name,
+            path, (char *) NULL);
+      _exit(1);
+    }
+    if (pid > 0)
+      waitpid(pid, NULL, 0);
+  }
+  return r.unmatched;
+}
+
+/* One thread of bench_replay()'s recorded workload. */
+struct replay_thread
+{
+  pthread_t thread;
+  unsigned long seed;           /* Random number state. */
+};
+
+/* Replaces random slots of a working set with blocks of mixed sizes,
+   mostly small, obtained every way the trace records, and grows or
+   shrinks some of them in place of a free. */
+static void *replay_worker(void *aux)
+{
+  enum { SLOTS = 4096, OPS = 300000 };
+  struct replay_thread *arg = aux;
+  static __thread void *slots[SLOTS];
+  unsigned long x = arg->seed;
+  int i;
+
+  for (i = 0; i < OPS + SLOTS; i++) {
+    size_t k = i < OPS ? (x >> 8) % SLOTS : (size_t) (i - OPS);
+    unsigned long r = (x >> 24) % 100;
+    size_t n = r < 80 ? 8 + (x >> 32) % 256
+               : r < 97 ? 256 + (x >> 32) % 3840 : 4096 + (x >> 32) % 61440;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    if (i >= OPS) {
+      if (slots[k] != NULL)
+        cy_free(slots[k]);
+      slots[k] = NULL;
+    }
+    else if (slots[k] == NULL)
+      slots[k] = r % 10 == 0 ? cy_calloc(1, n)
+                 : r % 10 == 1 ? cy_aligned_alloc(64, n) : cy_malloc(n);
+    else if (r % 4 == 0) {
+      void *q = cy_realloc(slots[k], n);
+
+      if (q != NULL)
+        slots[k] = q;
+    }
+    else {
+      cy_free(slots[k]);
+      slots[k] = NULL;
+    }
+  }
+  return NULL;
+}
+
+/* Runs bench_replay()'s workload in THREAD_CNT threads and returns
+   the ns it took per event. */
+static double replay_record(int thread_cnt)
+{
+  struct replay_thread threads[8];
+  double t0 = now_ns();
+  int i;
+
+  for (i = 0; i < thread_cnt; i++) {
+    threads[i].seed = 0x9e3779b97f4a7c15ul * (i + 1);
+    pthread_create(&threads[i].thread, NULL, replay_worker, &threads[i]);
+  }
+  for (i = 0; i < thread_cnt; i++)
+    pthread_join(threads[i].thread, NULL);
+  return (now_ns() - t0) / (thread_cnt * (300000.0 + 4096));
+}
+
+/* Trace recording and replay: runs a multi-threaded workload without
+   and with a trace being recorded, then replays the trace against
+   this allocator and glibc's.  Latencies include the cost of reading
+   the clock.  Peak KB is how far replaying raised the RSS; live KB,
+   the most bytes the trace asked for at once.  Every block the
+   workload frees, reallocs included, it allocated while being
+   traced, so the trace must have no unmatched frees, whichever
+   thread is handed a block another just gave back. */
+static void bench_replay(void)
+{
+  enum { THREADS = 4 };
+  double plain, traced;
+  size_t unmatched;
+  FILE *f;
+  long len = 0;
+
+  pool_init();
+  replay_record(THREADS);
+  plain = replay_record(THREADS);
+  if (!cy_trace_start(REPLAY_TRACE))
+    return;
+  traced = replay_record(THREADS);
+  cy_trace_stop();
+  f = fopen(REPLAY_TRACE, "rb");
+  if (f != NULL) {
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fclose(f);
+  }
+  printf("%-8s %10s %14s %12s\n", "trace", "threads", "ns/event",
+         "trace KB");
+  printf("%-8s %10s %14.1f %12s\n", "", "untraced", plain, "");
+  printf("%-8s %10d %14.1f %12ld\n", "", THREADS, traced, len >> 10);
+  unmatched = replay_file(REPLAY_TRACE);
+  remove(REPLAY_TRACE);
+  if (unmatched != 0) {
+    printf("[ERROR] the trace has unmatched frees\n");
+    exit(1);
+  }
+}
+
+/* Benchmark suite: standard allocator workloads, each run against
+   this allocator and the system's, in a process of its own so that
+   the peak RSS is the workload's alone, SUITE_RUNS times, keeping
+   the fastest run and the lowest peak.  Every SUITE_LAT_EVERY'th
+   call is timed for the latency percentiles, which include the cost
+   of reading the clock.  "make bench-suite" runs it and saves the
+   results; "./bench suite-compare OLD NEW" flags the workloads whose
+   throughput dropped by more than SUITE_TOLERANCE percent, or whose
+   peak RSS grew by more than that and SUITE_PEAK_SLACK KB, between
+   two saved runs. */
+#define SUITE_THREADS 4
+#define SUITE_RUNS 3
+#define SUITE_LAT_EVERY 32
+#define SUITE_LAT_MAX (1 << 18)
+#define SUITE_TOLERANCE 10
+#define SUITE_PEAK_SLACK 512
+
+/* One thread of a suite workload. */
+struct suite_thread
+{
+  pthread_t thread;
+  int idx;                      /* Index among the workload's threads. */
+  unsigned long x;              /* Random number state. */
+  size_t ops;                   /* Calls made. */
+  size_t lat_cnt;               /* Latencies in LAT. */
+  float *lat;                   /* Latencies of the timed calls, ns. */
+};
+
+static const struct bench_alloc *suite_alloc;
+static struct suite_thread suite_threads[SUITE_THREADS];
+
+/* Returns the next pseudo-random number of thread T. */
+static inline unsigned long suite_rand(struct suite_thread *t)
+{
+  t->x ^= t->x << 13;
+  t->x ^= t->x >> 7;
+  t->x ^= t->x << 17;
+  return t->x >> 8;
+}
+
+/* Keeps NS as the latency of one of T's calls. */
+static inline void suite_lat(struct suite_thread *t, double ns)
+{
+  if (t->lat_cnt < SUITE_LAT_MAX)
+    t->lat[t->lat_cnt++] = ns;
+}
+
+/* Calls the allocator's malloc() for thread T. */
+static inline void *suite_malloc(struct suite_thread *t, size_t n)
+{
+  double t0;
+  void *p;
+
+  if (++t->ops % SUITE_LAT_EVERY != 0)
+    return suite_alloc->malloc(n);
+  t0 = now_ns();
+  p = suite_alloc->malloc(n);
+  suite_lat(t, now_ns() - t0);
+  return p;
+}
+
+/* Calls the allocator's free() for thread T. */
+static inline void suite_free(struct suite_thread *t, void *p)
+{
+  double t0;
+
+  if (++t->ops % SUITE_LAT_EVERY != 0) {
+    suite_alloc->free(p);
+    return;
+  }
+  t0 = now_ns();
+  suite_alloc->free(p);
+  suite_lat(t, now_ns() - t0);
+}
+
+/* Runs BODY in CNT threads, each given its suite_thread, and waits
+   for them. */
+static void suite_spawn(int cnt, void *(*body) (void *))
+{
+  int i;
+
+  for (i = 0; i < cnt; i++) {
+    suite_threads[i].idx = i;
+    pthread_create(&suite_threads[i].thread, NULL, body, &suite_threads[i]);
+  }
+  for (i = 0; i < cnt; i++)
+    pthread_join(suite_threads[i].thread, NULL);
+}
+
+/* Small-object churn: one thread replaces random blocks of a window
+   of live ones with blocks of a size class, between half its size
+   and its size. */
+static size_t churn_size;
+
+static void *churn_body(void *aux)
+{
+  enum { LIVE = 1024, OPS = 2000000 };
+  struct suite_thread *t = aux;
+  void *live[LIVE] = { NULL };
+  size_t i;
+
+  for (i = 0; i < OPS; i++) {
+    size_t k = suite_rand(t) % LIVE;
+
+    if (live[k] != NULL)
+      suite_free(t, live[k]);
+    live[k] = suite_malloc(t, churn_size / 2 + 1
+                              + suite_rand(t) % (churn_size / 2));
+  }
+  for (i = 0; i < LIVE; i++)
+    if (live[i] != NULL)
+      suite_free(t, live[i]);
+  return NULL;
+}
+
+static void suite_churn(const char *name)
+{
+  churn_size = strtoul(name + strlen("churn"), NULL, 10);
+  suite_spawn(1, churn_body);
+}
+
+/* Larson: a server whose threads each replace random blocks of 10
+   to 500 bytes in a set of their own, then exit and hand the set to
+   a new thread, which frees what the old one allocated. */
+enum { LARSON_SLOTS = 1000, LARSON_ROUNDS = 20, LARSON_OPS = 50000 };
+static void *larson_slots[SUITE_THREADS][LARSON_SLOTS];
+static int larson_round;
+
+static void *larson_body(void *aux)
+{
+  struct suite_thread *t = aux;
+  void **slots = larson_slots[(t->idx + larson_round) % SUITE_THREADS];
+  size_t i;
+
+  for (i = 0; i < LARSON_OPS; i++) {
+    size_t k = suite_rand(t) % LARSON_SLOTS;
+
+    if (slots[k] != NULL)
+      suite_free(t, slots[k]);
+    slots[k] = suite_malloc(t, 10 + suite_rand(t) % 491);
+  }
+  return NULL;
+}
+
+static void suite_larson(const char *name)
+{
+  size_t i, j;
+
+  for (larson_round = 0; larson_round < LARSON_ROUNDS; larson_round++)
+    suite_spawn(SUITE_THREADS, larson_body);
+  for (i = 0; i < SUITE_THREADS; i++)
+    for (j = 0; j < LARSON_SLOTS; j++)
+      if (larson_slots[i][j] != NULL) {
+        suite_free(&suite_threads[0], larson_slots[i][j]);
+        larson_slots[i][j] = NULL;
+      }
+}
+
+/* Threadtest: every thread allocates a batch of 64-byte blocks and
+   then frees them all, over and over. */
+static void *threadtest_body(void *aux)
+{
+  enum { BATCH = 10000, ITERS = 50 };
+  struct suite_thread *t = aux;
+  void **blocks = malloc(BATCH * sizeof *blocks);
+  size_t i, it;
+
+  replay_touch(blocks, BATCH * sizeof *blocks);
+  for (it = 0; it < ITERS; it++) {
+    for (i = 0; i < BATCH; i++)
+      blocks[i] = suite_malloc(t, 64);
+    for (i = 0; i < BATCH; i++)
+      suite_free(t, blocks[i]);
+  }
+  free(blocks);
+  return NULL;
+}
+
+static void suite_threadtest(const char *name)
+{
+  suite_spawn(SUITE_THREADS, threadtest_body);
+}
+
+/* Big blocks: one thread replaces random blocks of a window with
+   blocks of 4 KB to 2 MB, about as many of each power of two, and
+   writes to the first page of each. */
+static void *bigmix_body(void *aux)
+{
+  enum { LIVE = 64, OPS = 100000 };
+  struct suite_thread *t = aux;
+  void *live[LIVE] = { NULL };
+  size_t i;
+
+  for (i = 0; i < OPS; i++) {
+    size_t k = suite_rand(t) % LIVE;
+    size_t n = (size_t) PGSIZE << suite_rand(t) % 9;
+
+    if (live[k] != NULL)
+      suite_free(t, live[k]);
+    live[k] = suite_malloc(t, n + suite_rand(t) % n);
+    if (live[k] != NULL)
+      *(volatile char *) live[k] = 0;
+  }
+  for (i = 0; i < LIVE; i++)
+    if (live[i] != NULL)
+      suite_free(t, live[i]);
+  return NULL;
+}
+
+static void suite_bigmix(const char *name)
+{
+  suite_spawn(1, bigmix_body);
+}
+
+/* Producer/consumer: pairs of threads, where one allocates blocks of
+   16 to 256 bytes and passes them through a ring to the other,
+   which frees them. */
+enum { PRODCONS_RING = 1024, PRODCONS_MSGS = 500000 };
+struct prodcons_ring
+{
+  void *slot[PRODCONS_RING];    /* Messages. */
+  atomic_size_t head, tail;     /* Next to write and read. */
+};
+static struct prodcons_ring prodcons_rings[SUITE_THREADS / 2];
+
+static void *prodcons_body(void *aux)
+{
+  struct suite_thread *t = aux;
+  struct prodcons_ring *r = &prodcons_rings[t->idx / 2];
+  size_t i;
+
+  for (i = 0; i < PRODCONS_MSGS; i++)
+    if (t->idx % 2 == 0) {
+      size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+      void *msg = suite_malloc(t, 16 + suite_rand(t) % 241);
+
+      while (head - atomic_load_explicit(&r->tail, memory_order_acquire)
+             == PRODCONS_RING)
+        sched_yield();
+      r->slot[head % PRODCONS_RING] = msg;
+      atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    }
+    else {
+      size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+      while (atomic_load_explicit(&r->head, memory_order_acquire) == tail)
+        sched_yield();
+      suite_free(t, r->slot[tail % PRODCONS_RING]);
+      atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    }
+  return NULL;
+}
+
+static void suite_prodcons(const char *name)
+{
+  suite_spawn(SUITE_THREADS, prodcons_body);
+}
+
+/* Long-running fragmentation: every round allocates many small
+   blocks, frees most of them but keeps some for good, and then
+   allocates and frees bigger ones, which can only reuse the holes
+   if the allocator keeps the survivors packed. */
+static void *frag_body(void *aux)
+{
+  enum { ROUNDS = 40, SMALL = 20000, KEEP = 20, MEDIUM = 2000 };
+  struct suite_thread *t = aux;
+  void **small = malloc(SMALL * sizeof *small);
+  void **kept = malloc(ROUNDS * SMALL / KEEP * sizeof *kept);
+  void **medium = malloc(MEDIUM * sizeof *medium);
+  size_t kept_cnt = 0, r, i;
+
+  replay_touch(small, SMALL * sizeof *small);
+  replay_touch(kept, ROUNDS * SMALL / KEEP * sizeof *kept);
+  replay_touch(medium, MEDIUM * sizeof *medium);
+  for (r = 0; r < ROUNDS; r++) {
+    for (i = 0; i < SMALL; i++)
+      small[i] = suite_malloc(t, 16 + suite_rand(t) % 497);
+    for (i = 0; i < SMALL; i++)
+      if (suite_rand(t) % KEEP == 0 && kept_cnt < ROUNDS * SMALL / KEEP)
+        kept[kept_cnt++] = small[i];
+      else
+        suite_free(t, small[i]);
+    for (i = 0; i < MEDIUM; i++)
+      medium[i] = suite_malloc(t, 1024 + suite_rand(t) % 7169);
+    for (i = 0; i < MEDIUM; i++)
+      suite_free(t, medium[i]);
+  }
+  for (i = 0; i < kept_cnt; i++)
+    suite_free(t, kept[i]);
+  free(small);
+  free(kept);
+  free(medium);
+  return NULL;
+}
+
+static void suite_frag(const char *name)
+{
+  suite_spawn(1, frag_body);
+}
+
+/* A workload of the suite. */
+struct suite_workload
+{
+  const char *name;             /* Name in the results. */
+  void (*run) (const char *name); /* Runs it. */
+};
+
+static const struct suite_workload suite_workloads[] =
+{
+  { "churn16", suite_churn },
+  { "churn32", suite_churn },
+  { "churn64", suite_churn },
+  { "churn128", suite_churn },
+  { "churn256", suite_churn },
+  { "churn512", suite_churn },
+  { "churn1024", suite_churn },
+  { "churn2048", suite_churn },
+  { "larson", suite_larson },
+  { "threadtest", suite_threadtest },
+  { "bigmix", suite_bigmix },
+  { "prodcons", suite_prodcons },
+  { "frag", suite_frag },
+};
+
+/* One run of bench_suite(), in a process of its own: runs workload
+   NAME against allocator ALLOC and prints its results. */
+static void suite_run(const char *name, const char *alloc)
+{
+  const struct suite_workload *w = NULL;
+  float *lat;
+  size_t ops = 0, lat_cnt = 0, i;
+  double t0, secs;
+  long rss0, peak;
+
+  for (i = 0; i < sizeof suite_workloads / sizeof *suite_workloads; i++)
+    if (!strcmp(name, suite_workloads[i].name))
+      w = &suite_workloads[i];
+  for (i = 0; i < sizeof bench_allocs / sizeof *bench_allocs; i++)
+    if (!strcmp(alloc, bench_allocs[i].name))
+      suite_alloc = &bench_allocs[i];
+  if (w == NULL || suite_alloc == NULL)
+    return;
+  if (suite_alloc->malloc == cy_malloc) {
+    pool_init();
+    cy_free(cy_malloc(1));
+  }
+
+  /* Latencies go where neither allocator's footprint counts them. */
+  lat = mmap(NULL, SUITE_THREADS * SUITE_LAT_MAX * sizeof *lat,
+             PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+             -1, 0);
+  if (lat == MAP_FAILED)
+    return;
+  for (i = 0; i < SUITE_THREADS; i++) {
+    suite_threads[i].x = 0x9e3779b97f4a7c15ul * (i + 1);
+    suite_threads[i].lat = lat + i * SUITE_LAT_MAX;
+  }
+
+  reset_peak_rss();
+  rss0 = rss_kb();
+  t0 = now_ns();
+  w->run(name);
+  secs = (now_ns() - t0) / 1e9;
+  peak = peak_rss_kb() - rss0;
+
+  /* Gather every thread's latencies in front. */
+  for (i = 0; i < SUITE_THREADS; i++) {
+    memmove(lat + lat_cnt, suite_threads[i].lat,
+            suite_threads[i].lat_cnt * sizeof *lat);
+    lat_cnt += suite_threads[i].lat_cnt;
+    ops += suite_threads[i].ops;
+  }
+  qsort(lat, lat_cnt, sizeof *lat, replay_lat_cmp);
+  printf("%-10s %6s %10.2f %8.0f %8.0f %8.0f %10ld\n", name, alloc,
+         ops / secs / 1e6, lat[lat_cnt / 2], lat[lat_cnt * 99 / 100],
+         lat[lat_cnt * 999 / 1000], peak);
+}
+
+/* A row of suite results. */
+struct suite_row
+{
+  char name[32];                /* Workload. */
+  char alloc[16];               /* Allocator. */
+  double mops;                  /* Millions of calls per second. */
+  double p50, p99, p999;        /* Latency percentiles, ns. */
+  long peak;                    /* Peak RSS growth, KB. */
+};
+
+/* Parses LINE as a row of suite results into ROW.  Returns false if
+   it is not one. */
+static bool suite_parse(const char *line, struct suite_row *row)
+{
+  return sscanf(line, "%31s %15s %lf %lf %lf %lf %ld", row->name, row->alloc,
+                &row->mops, &row->p50, &row->p99, &row->p999,
+                &row->peak) == 7;
+}
+
+/* Runs every workload of the suite against every allocator. */
+static void bench_suite(void)
+{
+  size_t w, a;
+  int run;
+
+  printf("%-10s %6s %10s %8s %8s %8s %10s\n", "suite", "alloc", "Mops/s",
+         "p50 ns", "p99 ns", "p999 ns", "peak KB");
+  fflush(stdout);
+  for (w = 0; w < sizeof suite_workloads / sizeof *suite_workloads; w++)
+    for (a = 0; a < sizeof bench_allocs / sizeof *bench_allocs; a++) {
+      struct suite_row best = { .mops = -1 }, row;
+      char line[256];
+
+      for (run = 0; run < SUITE_RUNS; run++) {
+        int fd[2];
+        pid_t pid;
+        FILE *f;
+
+        if (pipe(fd) != 0)
+          continue;
+        pid = fork();
+        if (pid == 0) {
+          dup2(fd[1], STDOUT_FILENO);
+          close(fd[0]);
+          close(fd[1]);
+          execl("/proc/self/exe", "bench", "suite-run",
+                suite_workloads[w].name, bench_allocs[a].name, (char *) NULL);
+          _exit(1);
+        }
+        close(fd[1]);
+        f = fdopen(fd[0], "r");
+        while (f != NULL && fgets(line, sizeof line, f) != NULL)
+          if (suite_parse(line, &row)) {
+            if (best.mops >= 0 && row.peak > best.peak)
+              row.peak = best.peak;
+            if (row.mops > best.mops)
+              best = row;
+            else
+              best.peak = row.peak;
+          }
+        if (f != NULL)
+          fclose(f);
+        if (pid > 0)
+          waitpid(pid, NULL, 0);
+      }
+      if (best.mops >= 0)
+        printf("%-10s %6s %10.2f %8.0f %8.0f %8.0f %10ld\n", best.name,
+               best.alloc, best.mops, best.p50, best.p99, best.p999,
+               best.peak);
+    }
+}
+
+/* Reads up to MAX rows of suite results from the file at PATH into
+   ROWS.  Returns the number read, or -1 if the file cannot be
+   read. */
+static int suite_read(const char *path, struct suite_row *rows, int max)
+{
+  FILE *f = fopen(path, "r");
+  char line[256];
+  int cnt = 0;
+
+  if (f == NULL) {
+    printf("[ERROR] cannot read %s\n", path);
+    return -1;
+  }
+  while (cnt < max && fgets(line, sizeof line, f) != NULL)
+    if (suite_parse(line, &rows[cnt]))
+      cnt++;
+  fclose(f);
+  return cnt;
+}
+
+/* Compares this allocator's rows of the suite results at NEW_PATH
+   with those at OLD_PATH.  Returns the number of workloads that got
+   worse, as bench_suite() says, or -1 if a file cannot be read. */
+static int suite_compare(const char *old_path, const char *new_path)
+{
+  static struct suite_row old[128], new[128];
+  int old_cnt = suite_read(old_path, old, 128);
+  int new_cnt = suite_read(new_path, new, 128);
+  int regressions = 0, i, j;
+
+  if (old_cnt < 0 || new_cnt < 0)
+    return -1;
+  printf("%-10s %10s %10s %8s %10s %10s %8s\n", "compare", "old Mops/s",
+         "new Mops/s", "change", "old KB", "new KB", "change");
+  for (i = 0; i < new_cnt; i++) {
+    if (strcmp(new[i].alloc, "cy") != 0)
+      continue;
+    for (j = 0; j < old_cnt; j++)
+      if (!strcmp(old[j].alloc, "cy") && !strcmp(old[j].name, new[i].name)) {
+        double speed = 100 * (new[i].mops / old[j].mops - 1);
+        double size = old[j].peak > 0
+                      ? 100.0 * (new[i].peak - old[j].peak) / old[j].peak : 0;
+        bool worse = speed < -SUITE_TOLERANCE
+                     || (size > SUITE_TOLERANCE
+                         && new[i].peak - old[j].peak > SUITE_PEAK_SLACK);
+
+        printf("%-10s %10.2f %10.2f %7.1f%% %10ld %10ld %7.1f%%%s\n",
+               new[i].name, old[j].mops, new[i].mops, speed, old[j].peak,
+               new[i].peak, size, worse ? "  REGRESSION" : "");
+        regressions += worse;
+        break;
+      }
+  }
+  return regressions;
+}
+
+/* Heap profiler overhead: the hot loop of bench_free(), with the
+   profiler off and sampling one in every RATE bytes.  Only sampled
+   blocks do more than count down their size. */
+static void bench_prof(void)
+{
+  enum { HOT = 32, ROUNDS = 200000, SIZE = 64 };
+  static const size_t rates[] = { 0, 1 << 20, 512 << 10, 64 << 10, 4 << 10 };
+  static void *blocks[HOT];
+  size_t r, i;
+
+  pool_init();
+  cy_free(cy_malloc(SIZE));
+  printf("%-8s %10s %14s %14s\n", "prof", "rate", "ns/pair", "samples/M");
+  for (r = 0; r < sizeof rates / sizeof *rates; r++) {
+    double t0;
+    int round;
+
+    cy_mallopt(CY_M_PROF_RATE, rates[r]);
+    t0 = now_ns();
+    for (round = 0; round < ROUNDS; round++) {
+      for (i = 0; i < HOT; i++)
+        blocks[i] = cy_malloc(SIZE);
+      for (i = 0; i < HOT; i++)
+        cy_free(blocks[i]);
+    }
+    t0 = (now_ns() - t0) / ((double) ROUNDS * HOT);
+    if (rates[r] == 0)
+      printf("%-8s %10s %14.1f %14s\n", "", "off", t0, "0");
+    else
+      printf("%-8s %10zu %14.1f %14.0f\n", "", rates[r], t0,
+             1e6 * SIZE / rates[r]);
+  }
+  cy_mallopt(CY_M_PROF_RATE, 0);
+}
+
+/* Returns the value of FIELD, in kilobytes, from this process's
+   /proc/self/smaps_rollup, or -1 if it cannot be read. */
+static long smaps_kb(const char *field)
+{
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  size_t len = strlen(field);
+  char line[256];
+  long kb = -1;
+
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof line, f) != NULL)
+    if (!strncmp(line, field, len) && line[len] == ':') {
+      kb = strtol(line + len + 1, NULL, 10);
+      break;
+    }
+  fclose(f);
+  return kb;
+}
+
+/* Opens a counter of this thread's data TLB load misses in user
+   mode, disabled, or returns -1 if perf events are not available. */
+static int tlb_counter_open(void)
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof attr);
+  attr.size = sizeof attr;
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+/* Random access over small objects, with or without the huge page
+   layout as HUGE says.  Allocates 64-byte nodes interleaved with
+   200-byte fillers of another size class, links the nodes in a
+   random cycle and times a walk around it.  The layout has to be
+   chosen before the pool exists, so bench_tlb() runs this in a
+   fresh process. */
+static void tlb_run(bool huge)
+{
+  enum { NODES = 1 << 21, HOPS = 1 << 24 };
+  struct node { struct node *next; char pad[56]; };
+  struct node **nodes = malloc(NODES * sizeof *nodes);
+  struct node *n;
+  long long misses = -1;
+  int fd, i;
+  double t0, ns;
+
+  if (nodes == NULL || !cy_mallopt(CY_M_HUGEPAGE, huge)) {
+    printf("[ERROR] cannot set up the tlb run\n");
+    exit(1);
+  }
+  pool_init();
+  for (i = 0; i < NODES; i++) {
+    void *filler = cy_malloc(200);
+
+    nodes[i] = cy_malloc(sizeof (struct node));
+    if (nodes[i] == NULL || filler == NULL) {
+      printf("[ERROR] out of memory\n");
+      exit(1);
+    }
+    memset(filler, 0, 200);
+  }
+  for (i = NODES - 1; i > 0; i--) {
+    int k = bench_rand() % (i + 1);
+
+    n = nodes[i];
+    nodes[i] = nodes[k];
+    nodes[k] = n;
+  }
+  for (i = 0; i < NODES; i++)
+    nodes[i]->next = nodes[(i + 1) % NODES];
+  n = nodes[0];
+  free(nodes);
+
+  fd = tlb_counter_open();
+  if (fd >= 0)
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  t0 = now_ns();
+  for (i = 0; i < HOPS; i++)
+    n = n->next;
+  ns = (now_ns() - t0) / HOPS;
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof misses) != sizeof misses)
+      misses = -1;
+    close(fd);
+  }
+
+  /* N goes into the result so that the walk is not optimized
+     away. */
+  if (misses >= 0)
+    printf("%-8s %8s %10.1f %14.3f %12ld\n", "", huge ? "huge" : "4k",
+           ns + (n == NULL), (double) misses / HOPS,
+           smaps_kb("AnonHugePages") >> 10);
+  else
+    printf("%-8s %8s %10.1f %14s %12ld\n", "", huge ? "huge" : "4k",
+           ns + (n == NULL), "n/a", smaps_kb("AnonHugePages") >> 10);
+}
+
+/* TLB-sensitive random access with 4 KB pages and with the huge
+   page layout.  dTLB misses per hop come from perf events when
+   they are available; "THP MB" is the process's AnonHugePages. */
+static void bench_tlb(void)
+{
+  int huge;
+
+  printf("%-8s %8s %10s %14s %12s\n", "tlb", "layout", "ns/hop",
+         "dTLB miss/hop", "THP MB");
+  fflush(stdout);
+  for (huge = 0; huge <= 1; huge++) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+      execl("/proc/self/exe", "bench", "tlb-run", huge ? "huge" : "4k",
+            (char *) NULL);
+      _exit(1);
+    }
+    if (pid > 0)
+      waitpid(pid, NULL, 0);
+  }
+}
+
+/* A benchmark workload. */
+struct workload
+{
+  const char *name;             /* Name given on the command line. */
+  void (*run) (void);           /* Runs the workload and prints results. */
+};
+
+static const struct workload workloads[] =
+{
+  { "grow", bench_grow },
+  { "bitmap", bench_bitmap },
+  { "churn", bench_churn },
+  { "threads", bench_threads },
+  { "pc", bench_pc },
+  { "free", bench_free },
+  { "pingpong", bench_pingpong },
+  { "bigblock", bench_bigblock },
+  { "purge", bench_purge },
+  { "realloc", bench_realloc },
+  { "calloc", bench_calloc },
+  { "aligned", bench_aligned },
+  { "density", bench_density },
+  { "batch", bench_batch },
+  { "classes", bench_classes },
+  { "prof", bench_prof },
+  { "replay", bench_replay },
+  { "suite", bench_suite },
+  { "tlb", bench_tlb },
+};
+
+int main(int argc, char *argv[])
+{
+  size_t w_cnt = sizeof workloads / sizeof *workloads;
+  size_t i;
+  int j;
+
+  /* One run of bench_tlb(), in a process of its own. */
+  if (argc == 3 && !strcmp(argv[1], "tlb-run")) {
+    tlb_run(!strcmp(argv[2], "huge"));
+    return 0;
+  }
+  if (argc == 3 && !strcmp(argv[1], "classes-run")) {
+    classes_run(argv[2]);
+    return 0;
+  }
+  if (argc == 4 && !strcmp(argv[1], "replay-run")) {
+    replay_run(argv[2], argv[3]);
+    return 0;
+  }
+  if (argc == 3 && !strcmp(argv[1], "replay-file")) {
+    replay_file(argv[2]);
+    return 0;
+  }
+  if (argc == 4 && !strcmp(argv[1], "suite-run")) {
+    suite_run(argv[2], argv[3]);
+    return 0;
+  }
+  if (argc == 4 && !strcmp(argv[1], "suite-compare"))
+    return suite_compare(argv[2], argv[3]) != 0;
+
+  for (i = 0; i < w_cnt; i++) {
+    bool selected = argc < 2;
+
+    for (j = 1; j < argc; j++)
+      if (!strcmp(argv[j], workloads[i].name))
+        selected = true;
+    if (selected)
+      workloads[i].run();
+  }
+  return 0;
+}
@@ -3,6 +3,10 @@
 #include <stdio.h>
 #include "round.h"
 #include <assert.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 /* Element type. 
 
@@ -17,13 +21,36 @@ typedef unsigned long elem_type;
 /* Number of bits in an element. */
 #define ELEM_BITS (sizeof (elem_type) * 8)
 
+/* Maximum number of summary levels.  Enough for 2^32 bits, as
+   many as the fields of struct run_info can count. */
+#define BITMAP_LEVELS 6
+
+/* Number of children of each summary node. */
+#define FANOUT 64
+
+/* Free runs within the bits covered by one summary node. */
+struct run_info
+{
+  uint32_t head;    /* False bits at the start. */
+  uint32_t tail;    /* False bits at the end. */
+  uint32_t best;    /* Longest run of false bits anywhere. */
+};
+
 /* From the outside, a bitmap is an array of bits.
    From the inside, it's an array of elem_type (defined above)
-   that simulates an array of bits. */
+   that simulates an array of bits.
+
+   To find runs of false bits quickly, the bitmap also keeps a
+   summary tree of them.  levels[0] has one node per element of
+   BITS, each node of levels[K + 1] covers FANOUT nodes of
+   levels[K], and the top level has a single node. */
 struct bitmap
 {
   size_t bit_cnt;   /* Number of bits. */
   elem_type *bits;  /* Elements that represent bits. */
+  size_t level_cnt; /* Number of summary levels. */
+  size_t level_nodes[BITMAP_LEVELS];        /* Nodes in each level. */
+  struct run_info *levels[BITMAP_LEVELS];   /* Summary levels. */
 };
 
 /* Returns the index of the element that contains the bit
@@ -40,6 +67,25 @@ static inline elem_type bit_mask(size_t bit_idx)
   return (elem_type) 1 << (bit_idx % ELEM_BITS);
 }
 
+/* Returns an elem_type with bits LO through HI - 1 turned on.
+   Requires LO < HI <= ELEM_BITS. */
+static inline elem_type range_mask(size_t lo, size_t hi)
+{
+  return ((elem_type) -1 >> (ELEM_BITS - hi)) & ((elem_type) -1 << lo);
+}
+
+/* Returns the number of trailing zero bits in nonzero E. */
+static inline size_t elem_ctz(elem_type e)
+{
+  return __builtin_ctzl(e);
+}
+
+/* Returns the number of leading one bits in E. */
+static inline size_t elem_clo(elem_type e)
+{
+  return ~e == 0 ? ELEM_BITS : (size_t) __builtin_clzl(~e);
+}
+
 /* Returns the number of elements required for BIT_CNT bits. */
 static inline size_t elem_cnt(size_t bit_cnt)
 {
@@ -63,8 +109,39 @@ static inline size_t byte_cnt(size_t bit_cnt)
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
 */
+static void summary_update(struct bitmap *b, size_t first, size_t last);
+
 /* Creation and destruction. */
 
+/* Fills LEVEL_NODES with the number of nodes in each summary level
+   of a bitmap with BIT_CNT bits and returns the number of levels. */
+static size_t summary_levels(size_t bit_cnt, size_t level_nodes[BITMAP_LEVELS])
+{
+  size_t level_cnt = 0;
+  size_t nodes = elem_cnt(bit_cnt);
+
+  for (;;) {
+    assert(level_cnt < BITMAP_LEVELS);
+    level_nodes[level_cnt++] = nodes;
+    if (nodes <= 1)
+      return level_cnt;
+    nodes = DIV_ROUND_UP(nodes, FANOUT);
+  }
+}
+
+/* Returns the number of bytes needed for the summary of a bitmap
+   with BIT_CNT bits. */
+static size_t summary_size(size_t bit_cnt)
+{
+  size_t level_nodes[BITMAP_LEVELS];
+  size_t level_cnt = summary_levels(bit_cnt, level_nodes);
+  size_t size = 0;
+  size_t i;
+
+  for (i = 0; i < level_cnt; i++)
+    size += level_nodes[i] * sizeof (struct run_info);
+  return size;
+}
 
 /* Creates and returns a bitmap with BIT_CNT bits in the
    BLOCK_SIZE bytes of storage preallocated at BLOCK.
@@ -72,11 +149,22 @@ static inline size_t byte_cnt(size_t bit_cnt)
 struct bitmap *bitmap_create_in_buf(size_t bit_cnt, void *block, size_t block_size)
 {
   struct bitmap *b = block;
+  struct run_info *next;
+  size_t i;
 
   assert(block_size >= bitmap_buf_size(bit_cnt));
+  assert(bit_cnt <= UINT32_MAX);
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
+  b->level_cnt = summary_levels(bit_cnt, b->level_nodes);
+  next = (struct run_info *) (b->bits + elem_cnt(bit_cnt));
+  for (i = 0; i < b->level_cnt; i++) {
+    b->levels[i] = next;
+    next += b->level_nodes[i];
+  }
+  memset(b->levels[0], 0, summary_size(bit_cnt));
+
   bitmap_set_all(b, false);
   return b;
 }
@@ -85,7 +173,7 @@ struct bitmap *bitmap_create_in_buf(size_t bit_cnt, void *block, size_t block_si
    with BIT_CNT bits (for use with bitmap_create_in_buf()). */
 size_t bitmap_buf_size(size_t bit_cnt)
 {
-  return sizeof(struct bitmap) + byte_cnt(bit_cnt);
+  return sizeof(struct bitmap) + byte_cnt(bit_cnt) + summary_size(bit_cnt);
 }
 
 /* Returns the number of bits in B. */
@@ -112,6 +200,7 @@ void bitmap_mark(struct bitmap *b, size_t bit_idx)
   elem_type mask = bit_mask(bit_idx);
 
   b->bits[idx] |= mask;
+  summary_update(b, idx, idx);
 }
 
 /* Atomically sets the bit numbered BIT_IDX in B to false. */
@@ -121,6 +210,7 @@ void bitmap_reset(struct bitmap *b, size_t bit_idx)
   elem_type mask = bit_mask(bit_idx);
 
   b->bits[idx] &= ~mask;
+  summary_update(b, idx, idx);
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -138,34 +228,87 @@ void bitmap_set_all(struct bitmap *b, bool value)
   bitmap_set_multiple(b, 0, bitmap_size (b), value);
 }
 
+/* Sets the CNT bits starting at START in B to VALUE.
+   Whole elements are written at once; only the first and last
+   elements need a mask. */
 void bitmap_set_multiple(struct bitmap *b, size_t start, size_t cnt, bool value)
 {
-  size_t i;
+  size_t first, last, i;
+  elem_type mask;
 
   assert(b != NULL);
   assert(start <= b->bit_cnt);
   assert(start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set(b, start + i, value);
+  if (cnt == 0)
+    return;
+
+  first = elem_idx(start);
+  last = elem_idx(start + cnt - 1);
+  for (i = first; i <= last; i++) {
+    size_t lo = i == first ? start % ELEM_BITS : 0;
+    size_t hi = i == last ? (start + cnt - 1) % ELEM_BITS + 1 : ELEM_BITS;
+
+    mask = range_mask(lo, hi);
+    if (value)
+      b->bits[i] |= mask;
+    else
+      b->bits[i] &= ~mask;
+  }
+  summary_update(b, first, last);
 }
 
 /* Returns true if any bits in B between START and START + CNT,
    exclusive, are set to VALUE, and false otherwise. */
 bool bitmap_contains(const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
+  size_t first, last, i;
+
   assert(b != NULL);
   assert(start <= b->bit_cnt);
   assert(start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
+  if (cnt == 0)
+    return false;
+
+  first = elem_idx(start);
+  last = elem_idx(start + cnt - 1);
+  for (i = first; i <= last; i++) {
+    size_t lo = i == first ? start % ELEM_BITS : 0;
+    size_t hi = i == last ? (start + cnt - 1) % ELEM_BITS + 1 : ELEM_BITS;
+    elem_type e = value ? b->bits[i] : ~b->bits[i];
+
+    if (e & range_mask(lo, hi))
       return true;
+  }
   return false;
 }
 
+/* Returns the number of bits in B between START and START + CNT,
+   exclusive, that are set to VALUE. */
+size_t bitmap_count(const struct bitmap *b, size_t start, size_t cnt, bool value) 
+{
+  size_t first, last, i, value_cnt = 0;
+
+  assert(b != NULL);
+  assert(start <= b->bit_cnt);
+  assert(start + cnt <= b->bit_cnt);
+
+  if (cnt == 0)
+    return 0;
+
+  first = elem_idx(start);
+  last = elem_idx(start + cnt - 1);
+  for (i = first; i <= last; i++) {
+    size_t lo = i == first ? start % ELEM_BITS : 0;
+    size_t hi = i == last ? (start + cnt - 1) % ELEM_BITS + 1 : ELEM_BITS;
+    elem_type e = value ? b->bits[i] : ~b->bits[i];
+
+    value_cnt += __builtin_popcountl(e & range_mask(lo, hi));
+  }
+  return value_cnt;
+}
+
 /* Returns true if every bit in B between START and START + CNT,
    exclusive, is set to true, and false otherwise. */
 bool bitmap_all(const struct bitmap *b, size_t start, size_t cnt) 
@@ -173,21 +316,277 @@ bool bitmap_all(const struct bitmap *b, size_t start, size_t cnt)
   return !bitmap_contains(b, start, cnt, false);
 }
 
+/* Returns the element at index IDX of B with each bit that equals
+   VALUE turned on.  Bits past the end of B are always off. */
+static inline elem_type match_elem(const struct bitmap *b, size_t idx, bool value)
+{
+  elem_type e = value ? b->bits[idx] : ~b->bits[idx];
+
+  if (idx == elem_idx(b->bit_cnt) && b->bit_cnt % ELEM_BITS != 0)
+    e &= range_mask(0, b->bit_cnt % ELEM_BITS);
+  return e;
+}
+
+/* Returns the index of the first element of BITS at or after IDX,
+   and before END, that is not equal to SKIP, or END if there is
+   none.  SKIP must be all zeros or all ones, which lets the vector
+   paths compare bytes regardless of the width of elem_type. */
+static size_t skip_elems(const elem_type *bits, size_t idx, size_t end, elem_type skip)
+{
+#if defined(__AVX2__)
+  const size_t step = sizeof (__m256i) / sizeof (elem_type);
+  __m256i pattern = _mm256_set1_epi8((char) skip);
+
+  for (; idx + step <= end; idx += step) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (bits + idx));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern)) != -1)
+      break;
+  }
+#elif defined(__SSE2__)
+  const size_t step = sizeof (__m128i) / sizeof (elem_type);
+  __m128i pattern = _mm_set1_epi8((char) skip);
+
+  for (; idx + step <= end; idx += step) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (bits + idx));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern)) != 0xffff)
+      break;
+  }
+#endif
+  while (idx < end && bits[idx] == skip)
+    idx++;
+  return idx;
+}
+
+/* Returns the length of the longest run of set bits in E. */
+static size_t longest_run(elem_type e)
+{
+  size_t best = 0;
+
+  if (~e == 0)
+    return ELEM_BITS;
+  while (e != 0) {
+    size_t ones;
+
+    e >>= elem_ctz(e);
+    ones = elem_ctz(~e);
+    if (ones > best)
+      best = ones;
+    e >>= ones;
+  }
+  return best;
+}
+
+/* Returns the number of bits covered by node NODE of summary
+   level LEVEL in B. */
+static size_t node_bits(const struct bitmap *b, size_t level, size_t node)
+{
+  size_t span = ELEM_BITS;
+  size_t lo;
+
+  while (level-- > 0)
+    span *= FANOUT;
+  lo = node * span;
+  return b->bit_cnt - lo < span ? b->bit_cnt - lo : span;
+}
+
+/* Brings the summary of B up to date after elements FIRST through
+   LAST, inclusive, of its bits have changed.  Each changed node is
+   rebuilt from its FANOUT children, so this takes O(FANOUT) time
+   per level. */
+static void summary_update(struct bitmap *b, size_t first, size_t last)
+{
+  size_t level, i, c;
+
+  for (i = first; i <= last; i++) {
+    elem_type e = match_elem(b, i, false);
+    struct run_info *r = &b->levels[0][i];
+
+    r->head = ~e == 0 ? ELEM_BITS : elem_ctz(~e);
+    r->tail = elem_clo(e);
+    r->best = longest_run(e);
+  }
+
+  for (level = 1; level < b->level_cnt; level++) {
+    first /= FANOUT;
+    last /= FANOUT;
+    for (i = first; i <= last; i++) {
+      const struct run_info *child = b->levels[level - 1];
+      size_t c_first = i * FANOUT;
+      size_t c_end = c_first + FANOUT;
+      struct run_info r = { 0, 0, 0 };
+      bool all_free = true;
+      size_t run = 0;
+
+      if (c_end > b->level_nodes[level - 1])
+        c_end = b->level_nodes[level - 1];
+      for (c = c_first; c < c_end; c++) {
+        size_t len = node_bits(b, level - 1, c);
+
+        if (child[c].best > r.best)
+          r.best = child[c].best;
+        if (child[c].head == len) {
+          run += len;
+          if (all_free)
+            r.head += len;
+        }
+        else {
+          if (run + child[c].head > r.best)
+            r.best = run + child[c].head;
+          if (all_free)
+            r.head += child[c].head;
+          all_free = false;
+          run = child[c].tail;
+        }
+      }
+      if (run > r.best)
+        r.best = run;
+      r.tail = run;
+      b->levels[level][i] = r;
+    }
+  }
+}
+
+/* Extends the run of *RUN_LEN matching bits that began at bit
+   *RUN_START through element E, whose bits are numbered from BASE,
+   looking for CNT matching bits in a row.  Returns true if the run
+   reached CNT bits, which then start at *RUN_START; otherwise
+   leaves the run still open at the end of E in *RUN_START and
+   *RUN_LEN.  Runs are measured with ctz rather than bit by bit. */
+static bool elem_find(elem_type e, size_t base, size_t cnt,
+                      size_t *run_start, size_t *run_len)
+{
+  size_t pos = 0;
+
+  if (e == (elem_type) -1) {
+    if (*run_len == 0)
+      *run_start = base;
+    *run_len += ELEM_BITS;
+    return *run_len >= cnt;
+  }
+
+  while (pos < ELEM_BITS) {
+    elem_type r = e >> pos;
+    size_t ones;
+
+    if (r == 0) {
+      *run_len = 0;
+      break;
+    }
+    if ((r & 1) == 0) {
+      /* The current run (if any) ends here; skip to the next
+         matching bit. */
+      *run_len = 0;
+      pos += elem_ctz(r);
+      r = e >> pos;
+    }
+    if (*run_len == 0)
+      *run_start = base + pos;
+    ones = ~r == 0 ? ELEM_BITS - pos : elem_ctz(~r);
+    *run_len += ones;
+    if (*run_len >= cnt)
+      return true;
+    pos += ones;
+  }
+  return false;
+}
+
+/* Searches the bits covered by node NODE of summary level LEVEL in
+   B for CNT false bits in a row at or after bit START.  The run
+   open just before the node is passed in *RUN_START and *RUN_LEN,
+   which are updated as for elem_find().  Returns the index of the
+   first bit of the run, or BITMAP_ERROR.
+
+   Children wholly past START are judged by their run_info alone:
+   a child is descended into only if the run can end inside it, so
+   a search visits O(FANOUT) nodes per level. */
+static size_t summary_find(const struct bitmap *b, size_t level, size_t node,
+                           size_t start, size_t cnt,
+                           size_t *run_start, size_t *run_len)
+{
+  size_t span = ELEM_BITS;
+  size_t lo, c, c_end;
+  size_t i;
+
+  if (level == 0) {
+    elem_type e = match_elem(b, node, false);
+
+    if (start > node * ELEM_BITS)
+      e &= (elem_type) -1 << (start % ELEM_BITS);
+    return elem_find(e, node * ELEM_BITS, cnt, run_start, run_len)
+           ? *run_start : BITMAP_ERROR;
+  }
+
+  for (i = 1; i < level; i++)
+    span *= FANOUT;
+  c = node * FANOUT;
+  c_end = c + FANOUT;
+  if (c_end > b->level_nodes[level - 1])
+    c_end = b->level_nodes[level - 1];
+
+  for (lo = c * span; c < c_end; c++, lo += span) {
+    const struct run_info *r = &b->levels[level - 1][c];
+    size_t len = node_bits(b, level - 1, c);
+
+    if (lo + len <= start)
+      continue;
+    if (lo < start || *run_len + r->head >= cnt || r->best >= cnt) {
+      size_t idx = summary_find(b, level - 1, c, start, cnt,
+                                run_start, run_len);
+      if (idx != BITMAP_ERROR)
+        return idx;
+    }
+    else if (r->head == len) {
+      if (*run_len == 0)
+        *run_start = lo;
+      *run_len += len;
+    }
+    else {
+      *run_len = r->tail;
+      *run_start = lo + len - r->tail;
+    }
+  }
+  return BITMAP_ERROR;
+}
+
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
-   If there is no such group, returns BITMAP_ERROR. */
+   If there is no such group, returns BITMAP_ERROR.
+
+   Searches for false bits walk the summary tree.  Searches for true
+   bits scan B one element at a time, skipping elements that are all
+   false in bulk while no run is in progress. */
 size_t bitmap_scan(const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
+  size_t run_start = 0, run_len = 0;
+  size_t n, idx;
+  elem_type e;
+
   assert (b != NULL);
   assert (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains(b, i, cnt, !value))
-          return i; 
+  if (cnt > b->bit_cnt - start)
+    return BITMAP_ERROR;
+  if (cnt == 0)
+    return start;
+  if (!value)
+    return summary_find(b, b->level_cnt - 1, 0, start, cnt,
+                        &run_start, &run_len);
+
+  n = elem_cnt(b->bit_cnt);
+  idx = elem_idx(start);
+  e = match_elem(b, idx, value) & ((elem_type) -1 << (start % ELEM_BITS));
+  for (;;) {
+    if (elem_find(e, idx * ELEM_BITS, cnt, &run_start, &run_len))
+      return run_start;
+    if (++idx >= n)
+      break;
+    if (run_len == 0) {
+      idx = skip_elems(b->bits, idx, n, 0);
+      if (idx >= n)
+        break;
+    }
+    e = match_elem(b, idx, value);
   }
   return BITMAP_ERROR;
 }
@@ -208,6 +607,12 @@ size_t bitmap_scan_and_flip(struct bitmap *b, size_t start, size_t cnt, bool val
   return idx;
 }
 
+/* Returns the length of the longest run of false bits in B. */
+size_t bitmap_longest_run(const struct bitmap *b)
+{
+  return b->levels[b->level_cnt - 1][0].best;
+}
+
 /* Print bitmap. */
 /*static inline void bitmap_print(struct bitmap *b)
 {
@@ -0,0 +1,226 @@
+#include "cy_buddy.h"
+#include <stdbool.h>
+#include <assert.h>
+#include "round.h"
+
+/* Buddy page allocator.
+
+   The pool's pages are split into blocks of 2^K pages, where K is
+   the block's order, and every block starts at a page index that is
+   a multiple of its size.  Each order has a list of free blocks.
+   An allocation takes a block of the smallest order that fits,
+   splitting a larger one in halves as needed; a free merges the
+   block with its buddy, the other half of the block it was split
+   from, for as long as the buddy is free too.  Both take O(log n)
+   steps.
+
+   The state lives out of line, one buddy_page per page of the pool,
+   so free pages are never written. */
+
+/* Number of block orders. */
+#define ORDER_CNT 32
+
+/* No page; ends a free list. */
+#define NIL UINT32_MAX
+
+/* State of one page.  Only meaningful for the first page of a
+   block. */
+struct buddy_page
+{
+  uint32_t prev;    /* Previous free block of this order, or NIL. */
+  uint32_t next;    /* Next free block of this order, or NIL. */
+  uint8_t order;    /* Order of the block starting here. */
+  bool free;        /* Is the block on a free list? */
+};
+
+/* A buddy allocator. */
+struct buddy
+{
+  size_t page_cnt;                  /* Number of pages. */
+  size_t free_cnt;                  /* Number of free pages. */
+  uint32_t orders;                  /* Bit K set if free_lists[K] is nonempty. */
+  uint32_t free_lists[ORDER_CNT];   /* First free block of each order. */
+  struct buddy_page *pages;         /* One per page. */
+};
+
+/* Returns the order of the smallest block that holds PAGE_CNT
+   pages. */
+static inline size_t order_for(size_t page_cnt)
+{
+  return page_cnt <= 1 ? 0 : sizeof (long) * 8 - __builtin_clzl(page_cnt - 1);
+}
+
+/* Adds the block of order ORDER at IDX to its free list. */
+static void push_free(struct buddy *b, size_t idx, size_t order)
+{
+  struct buddy_page *p = &b->pages[idx];
+
+  p->prev = NIL;
+  p->next = b->free_lists[order];
+  p->order = order;
+  p->free = true;
+  if (p->next != NIL)
+    b->pages[p->next].prev = idx;
+  b->free_lists[order] = idx;
+  b->orders |= 1u << order;
+}
+
+/* Removes the free block at IDX from its free list. */
+static void remove_free(struct buddy *b, size_t idx)
+{
+  struct buddy_page *p = &b->pages[idx];
+
+  if (p->prev != NIL)
+    b->pages[p->prev].next = p->next;
+  else
+    b->free_lists[p->order] = p->next;
+  if (p->next != NIL)
+    b->pages[p->next].prev = p->prev;
+  if (b->free_lists[p->order] == NIL)
+    b->orders &= ~(1u << p->order);
+  p->free = false;
+}
+
+/* Creates and returns a buddy allocator for PAGE_CNT pages in the
+   BLOCK_SIZE bytes of storage preallocated at BLOCK.
+   BLOCK_SIZE must be at least buddy_buf_size(PAGE_CNT).
+   All pages start out free. */
+struct buddy *buddy_create_in_buf(size_t page_cnt, void *block, size_t block_size)
+{
+  struct buddy *b = block;
+  size_t idx, order;
+
+  assert(block_size >= buddy_buf_size(page_cnt));
+  assert(page_cnt < NIL);
+
+  b->page_cnt = page_cnt;
+  b->free_cnt = page_cnt;
+  b->orders = 0;
+  for (order = 0; order < ORDER_CNT; order++)
+    b->free_lists[order] = NIL;
+  b->pages = (struct buddy_page *) (b + 1);
+
+  /* Carve the pages into the largest aligned blocks that fit. */
+  for (idx = 0; idx < page_cnt; idx += (size_t) 1 << order) {
+    order = idx == 0 ? ORDER_CNT - 1 : (size_t) __builtin_ctzl(idx);
+    if (order > ORDER_CNT - 1)
+      order = ORDER_CNT - 1;
+    while (idx + ((size_t) 1 << order) > page_cnt)
+      order--;
+    push_free(b, idx, order);
+  }
+  return b;
+}
+
+/* Returns the number of bytes required for a buddy allocator with
+   PAGE_CNT pages (for use with buddy_create_in_buf()). */
+size_t buddy_buf_size(size_t page_cnt)
+{
+  return sizeof (struct buddy) + page_cnt * sizeof (struct buddy_page);
+}
+
+/* Allocates a block of at least PAGE_CNT pages, rounded up to a
+   power of two, and returns the index of its first page, or
+   BUDDY_ERROR if there is no free block that large. */
+size_t buddy_alloc(struct buddy *b, size_t page_cnt)
+{
+  size_t order = order_for(page_cnt);
+  size_t avail, idx, j;
+
+  if (page_cnt == 0 || order >= ORDER_CNT)
+    return BUDDY_ERROR;
+  avail = b->orders & ~((1u << order) - 1);
+  if (avail == 0)
+    return BUDDY_ERROR;
+
+  /* Take the smallest free block that fits and split it down. */
+  j = __builtin_ctz(avail);
+  idx = b->free_lists[j];
+  remove_free(b, idx);
+  while (j > order) {
+    j--;
+    push_free(b, idx + ((size_t) 1 << j), j);
+  }
+  b->pages[idx].order = order;
+  b->free_cnt -= (size_t) 1 << order;
+  return idx;
+}
+
+/* Frees the block of PAGE_CNT pages at page IDX, which must have
+   been returned by buddy_alloc() for the same PAGE_CNT. */
+void buddy_free(struct buddy *b, size_t idx, size_t page_cnt)
+{
+  size_t order = order_for(page_cnt);
+
+  assert(idx < b->page_cnt);
+  assert(!b->pages[idx].free && b->pages[idx].order == order);
+
+  b->free_cnt += (size_t) 1 << order;
+
+  /* Merge with the buddy for as long as it is free and whole. */
+  while (order + 1 < ORDER_CNT) {
+    size_t buddy = idx ^ ((size_t) 1 << order);
+
+    if (buddy + ((size_t) 1 << order) > b->page_cnt
+        || !b->pages[buddy].free || b->pages[buddy].order != order)
+      break;
+    remove_free(b, buddy);
+    if (buddy < idx)
+      idx = buddy;
+    order++;
+  }
+  push_free(b, idx, order);
+}
+
+/* Resizes the block of OLD_CNT pages at page IDX, which must have
+   been returned by buddy_alloc() for OLD_CNT, in place to hold
+   NEW_CNT pages.  Shrinking frees the halves that are no longer
+   needed; growing takes the buddies the block would merge with,
+   which must all be free.  Returns false, changing nothing, if the
+   block cannot grow in place. */
+bool buddy_resize(struct buddy *b, size_t idx, size_t old_cnt, size_t new_cnt)
+{
+  size_t order = order_for(old_cnt);
+  size_t new_order = order_for(new_cnt);
+  size_t j;
+
+  assert(idx < b->page_cnt);
+  assert(!b->pages[idx].free && b->pages[idx].order == order);
+
+  if (new_cnt == 0)
+    return false;
+  if (new_order < order) {
+    for (j = order; j > new_order; j--)
+      push_free(b, idx + ((size_t) 1 << (j - 1)), j - 1);
+  }
+  else if (new_order > order) {
+    if (new_order >= ORDER_CNT || idx % ((size_t) 1 << new_order) != 0
+        || idx + ((size_t) 1 << new_order) > b->page_cnt)
+      return false;
+    for (j = order; j < new_order; j++) {
+      size_t buddy = idx + ((size_t) 1 << j);
+
+      if (!b->pages[buddy].free || b->pages[buddy].order != j)
+        return false;
+    }
+    for (j = order; j < new_order; j++)
+      remove_free(b, idx + ((size_t) 1 << j));
+  }
+  b->pages[idx].order = new_order;
+  b->free_cnt += ((size_t) 1 << order) - ((size_t) 1 << new_order);
+  return true;
+}
+
+/* Returns the number of free pages in B. */
+size_t buddy_free_pages(const struct buddy *b)
+{
+  return b->free_cnt;
+}
+
+/* Returns the number of pages in B's largest free block. */
+size_t buddy_largest_free(const struct buddy *b)
+{
+  if (b->orders == 0)
+    return 0;
+  return (size_t) 1 << (31 - __builtin_clz(b->orders));
+}
@@ -0,0 +1,306 @@
+#include "cy_extent.h"
+#include <stdbool.h>
+#include <assert.h>
+
+/* Best-fit page allocator over free extents.
+
+   A free extent is a maximal run of free pages.  The extents are
+   kept in segregated bins keyed by length: one bin for each length
+   up to EXACT_BINS pages, then four bins per doubling above that.
+   An allocation takes the smallest extent it finds in the first
+   nonempty bin that can satisfy it and returns the remainder to the
+   bins, so a request for N pages costs N pages, not N rounded up to
+   a power of two.
+
+   The first and last page of every extent, free or allocated, carry
+   a boundary tag with the extent's length.  A free looks at the tag
+   of the page just before and just after the freed pages and merges
+   with either neighbour that is free, so two free extents are never
+   adjacent.
+
+   The state lives out of line, one extent_page per page of the pool,
+   so free pages are never written. */
+
+/* Lengths that get a bin of their own. */
+#define EXACT_BINS 64
+
+/* Number of bins: the exact ones, then four per doubling up to
+   2^32 pages. */
+#define BIN_CNT (EXACT_BINS + 4 * (32 - 6))
+
+/* Most extents examined per bin when looking for the best fit.
+   If none of them fits, extent_alloc() falls back to the first fit
+   in the request's own bin, so the cap never makes it fail. */
+#define FIT_SCAN_MAX 32
+
+/* No page; ends a bin. */
+#define NIL UINT32_MAX
+
+/* Boundary tag.  Only meaningful for the first and last page of an
+   extent; PREV and NEXT only for the first page of a free one. */
+struct extent_page
+{
+  uint32_t prev;    /* Previous free extent in this bin, or NIL. */
+  uint32_t next;    /* Next free extent in this bin, or NIL. */
+  uint32_t len;     /* Pages in the extent. */
+  bool free;        /* Is the extent free? */
+};
+
+/* A free extent index. */
+struct extent_index
+{
+  size_t page_cnt;                  /* Number of pages. */
+  size_t free_cnt;                  /* Number of free pages. */
+  uint64_t nonempty[(BIN_CNT + 63) / 64];   /* Bit K set if bins[K] is nonempty. */
+  uint32_t bins[BIN_CNT];           /* First free extent of each bin. */
+  struct extent_page *pages;        /* One per page. */
+};
+
+/* Returns the bin for extents of LEN pages. */
+static inline size_t bin_for(size_t len)
+{
+  size_t lg;
+
+  if (len <= EXACT_BINS)
+    return len - 1;
+  lg = sizeof (long) * 8 - 1 - __builtin_clzl(len);
+  return EXACT_BINS + (lg - 6) * 4 + ((len >> (lg - 2)) & 3);
+}
+
+/* Writes the boundary tags of the extent of LEN pages at IDX. */
+static void tag(struct extent_index *e, size_t idx, size_t len, bool free)
+{
+  e->pages[idx].len = len;
+  e->pages[idx].free = free;
+  e->pages[idx + len - 1].len = len;
+  e->pages[idx + len - 1].free = free;
+}
+
+/* Adds the free extent of LEN pages at IDX to its bin. */
+static void push_free(struct extent_index *e, size_t idx, size_t len)
+{
+  struct extent_page *p = &e->pages[idx];
+  size_t bin = bin_for(len);
+
+  tag(e, idx, len, true);
+  p->prev = NIL;
+  p->next = e->bins[bin];
+  if (p->next != NIL)
+    e->pages[p->next].prev = idx;
+  e->bins[bin] = idx;
+  e->nonempty[bin / 64] |= (uint64_t) 1 << (bin % 64);
+}
+
+/* Removes the free extent at IDX from its bin.  Its tags still say
+   it is free; the caller retags it. */
+static void remove_free(struct extent_index *e, size_t idx)
+{
+  struct extent_page *p = &e->pages[idx];
+  size_t bin = bin_for(p->len);
+
+  if (p->prev != NIL)
+    e->pages[p->prev].next = p->next;
+  else
+    e->bins[bin] = p->next;
+  if (p->next != NIL)
+    e->pages[p->next].prev = p->prev;
+  if (e->bins[bin] == NIL)
+    e->nonempty[bin / 64] &= ~((uint64_t) 1 << (bin % 64));
+}
+
+/* Returns the first nonempty bin at or after BIN, or BIN_CNT if
+   there is none. */
+static size_t next_bin(const struct extent_index *e, size_t bin)
+{
+  size_t word = bin / 64;
+  uint64_t bits;
+
+  if (bin >= BIN_CNT)
+    return BIN_CNT;
+  bits = e->nonempty[word] & (~(uint64_t) 0 << (bin % 64));
+  while (bits == 0) {
+    if (++word == sizeof e->nonempty / sizeof *e->nonempty)
+      return BIN_CNT;
+    bits = e->nonempty[word];
+  }
+  return word * 64 + __builtin_ctzll(bits);
+}
+
+/* Returns the shortest extent of at least PAGE_CNT pages among the
+   first FIT_SCAN_MAX in BIN, or NIL if none of them is long
+   enough. */
+static uint32_t best_in_bin(const struct extent_index *e, size_t bin, size_t page_cnt)
+{
+  uint32_t idx, best = NIL;
+  size_t scanned;
+
+  for (idx = e->bins[bin], scanned = 0; idx != NIL && scanned < FIT_SCAN_MAX;
+       idx = e->pages[idx].next, scanned++) {
+    size_t len = e->pages[idx].len;
+
+    if (len >= page_cnt && (best == NIL || len < e->pages[best].len)) {
+      best = idx;
+      if (len == page_cnt)
+        break;
+    }
+  }
+  return best;
+}
+
+/* Returns the first extent of at least PAGE_CNT pages in BIN, or
+   NIL if none is long enough. */
+static uint32_t first_in_bin(const struct extent_index *e, size_t bin, size_t page_cnt)
+{
+  uint32_t idx;
+
+  for (idx = e->bins[bin]; idx != NIL; idx = e->pages[idx].next)
+    if (e->pages[idx].len >= page_cnt)
+      break;
+  return idx;
+}
+
+/* Creates and returns a free extent index for PAGE_CNT pages in the
+   BLOCK_SIZE bytes of storage preallocated at BLOCK.
+   BLOCK_SIZE must be at least extent_buf_size(PAGE_CNT).
+   All pages start out free, as one extent. */
+struct extent_index *extent_create_in_buf(size_t page_cnt, void *block, size_t block_size)
+{
+  struct extent_index *e = block;
+  size_t bin;
+
+  assert(block_size >= extent_buf_size(page_cnt));
+  assert(page_cnt < NIL);
+
+  e->page_cnt = page_cnt;
+  e->free_cnt = page_cnt;
+  for (bin = 0; bin < sizeof e->nonempty / sizeof *e->nonempty; bin++)
+    e->nonempty[bin] = 0;
+  for (bin = 0; bin < BIN_CNT; bin++)
+    e->bins[bin] = NIL;
+  e->pages = (struct extent_page *) (e + 1);
+  if (page_cnt > 0)
+    push_free(e, 0, page_cnt);
+  return e;
+}
+
+/* Returns the number of bytes required for a free extent index with
+   PAGE_CNT pages (for use with extent_create_in_buf()). */
+size_t extent_buf_size(size_t page_cnt)
+{
+  return sizeof (struct extent_index) + page_cnt * sizeof (struct extent_page);
+}
+
+/* Allocates PAGE_CNT consecutive pages from the shortest free
+   extent that holds them and returns the index of the first page,
+   or EXTENT_ERROR if no free extent is that long. */
+size_t extent_alloc(struct extent_index *e, size_t page_cnt)
+{
+  size_t bin, len;
+  uint32_t idx = NIL;
+
+  if (page_cnt == 0 || page_cnt > e->page_cnt)
+    return EXTENT_ERROR;
+
+  /* Extents in PAGE_CNT's own bin may be too short; those in later
+     bins never are. */
+  for (bin = next_bin(e, bin_for(page_cnt)); bin < BIN_CNT && idx == NIL;
+       bin = next_bin(e, bin + 1))
+    idx = best_in_bin(e, bin, page_cnt);
+
+  /* The long enough extents in PAGE_CNT's own bin may all come
+     after the first FIT_SCAN_MAX. */
+  if (idx == NIL)
+    idx = first_in_bin(e, bin_for(page_cnt), page_cnt);
+  if (idx == NIL)
+    return EXTENT_ERROR;
+
+  len = e->pages[idx].len;
+  remove_free(e, idx);
+  tag(e, idx, page_cnt, false);
+  if (len > page_cnt)
+    push_free(e, idx + page_cnt, len - page_cnt);
+  e->free_cnt -= page_cnt;
+  return idx;
+}
+
+/* Frees the PAGE_CNT pages at page IDX, which must have been
+   returned by extent_alloc() for the same PAGE_CNT, and merges them
+   with the free extents on either side. */
+void extent_free(struct extent_index *e, size_t idx, size_t page_cnt)
+{
+  size_t end = idx + page_cnt;
+
+  assert(end <= e->page_cnt);
+  assert(!e->pages[idx].free && e->pages[idx].len == page_cnt);
+
+  e->free_cnt += page_cnt;
+
+  if (idx > 0 && e->pages[idx - 1].free) {
+    size_t prev = idx - e->pages[idx - 1].len;
+
+    remove_free(e, prev);
+    idx = prev;
+  }
+  if (end < e->page_cnt && e->pages[end].free) {
+    remove_free(e, end);
+    end += e->pages[end].len;
+  }
+  push_free(e, idx, end - idx);
+}
+
+/* Resizes the OLD_CNT pages at page IDX, which must have been
+   returned by extent_alloc() for OLD_CNT pages, in place to NEW_CNT
+   pages.  Shrinking frees the tail; growing takes pages from the
+   free extent right after them, which must be long enough.  Returns
+   false, changing nothing, if the pages cannot grow in place. */
+bool extent_resize(struct extent_index *e, size_t idx, size_t old_cnt, size_t new_cnt)
+{
+  size_t end = idx + old_cnt;
+
+  assert(end <= e->page_cnt);
+  assert(!e->pages[idx].free && e->pages[idx].len == old_cnt);
+
+  if (new_cnt == 0)
+    return false;
+  if (new_cnt < old_cnt) {
+    tag(e, idx, new_cnt, false);
+    tag(e, idx + new_cnt, old_cnt - new_cnt, false);
+    extent_free(e, idx + new_cnt, old_cnt - new_cnt);
+  }
+  else if (new_cnt > old_cnt) {
+    size_t need = new_cnt - old_cnt;
+    size_t len;
+
+    if (end == e->page_cnt || !e->pages[end].free
+        || (len = e->pages[end].len) < need)
+      return false;
+    remove_free(e, end);
+    tag(e, idx, new_cnt, false);
+    if (len > need)
+      push_free(e, end + need, len - need);
+    e->free_cnt -= need;
+  }
+  return true;
+}
+
+/* Returns the number of free pages in E. */
+size_t extent_free_pages(const struct extent_index *e)
+{
+  return e->free_cnt;
+}
+
+/* Returns the number of pages in E's longest free extent. */
+size_t extent_largest_free(const struct extent_index *e)
+{
+  size_t bin, last = BIN_CNT, longest = 0;
+  uint32_t idx;
+
+  for (bin = next_bin(e, 0); bin < BIN_CNT; bin = next_bin(e, bin + 1))
+    last = bin;
+  if (last == BIN_CNT)
+    return 0;
+  for (idx = e->bins[last]; idx != NIL; idx = e->pages[idx].next)
+    if (e->pages[idx].len > longest)
+      longest = e->pages[idx].len;
+  return longest;
+}
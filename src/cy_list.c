@@ -72,6 +72,15 @@ struct list_elem *list_end(struct list *list)
   return &list->tail;
 }
 
+/* Returns the element after ELEM in its list.  If ELEM is the
+   last element in its list, returns the list tail.  Results are
+   undefined if ELEM is itself a list tail. */
+struct list_elem *list_next(struct list_elem *elem)
+{
+  assert(elem != NULL && elem->next != NULL);
+  return elem->next;
+}
+
 /* Inserts ELEM just before BEFORE, which may be either an
    interior element or a tail.  The latter case is equivalent to
    list_push_back(). */
@@ -151,6 +160,14 @@ struct list_elem * list_front(struct list *list)
   return list->head.next;
 }
 
+/* Returns the back element in LIST.
+   Undefined behavior if LIST is empty. */
+struct list_elem *list_back(struct list *list)
+{
+  assert(!list_empty(list));
+  return list->tail.prev;
+}
+
 /* Returns true if LIST is empty, false otherwise. */
 bool list_empty(struct list *list)
 {
@@ -1,38 +1,211 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/mman.h>
 #include "cy_malloc.h"
 #include "cy_list.h"
 #include "round.h"
 #include "cy_bitmap.h"
+#include "cy_buddy.h"
+#include "cy_extent.h"
 #include "cy_vaddr.h"
 
-/* A memory pool. */
+/* A memory pool, one per region handed to the allocator.
+   page_alloc selects how pages are tracked: CY_PALLOC_BITMAP uses
+   USED_MAP, CY_PALLOC_BUDDY uses BUDDY, CY_PALLOC_EXTENT uses
+   EXTENTS. */
 struct pool
 {
+	pthread_mutex_t lock;					/* Mutual exclusion. */
 	struct bitmap *used_map;			/* Bitmap of free pages. */
+	struct buddy *buddy;					/* Buddy allocator. */
+	struct extent_index *extents;	/* Free extents, best fit. */
+	void *start;							/* Start of region, at used_map. */
 	void *base;								/* Base of pool. */
+	void *end;								/* End of pool. */
+	void *commit_end;					/* End of the pages that are mapped
+	                                 readable and writable. */
+	struct bitmap *dirty_map;			/* Free pages not yet purged. */
+	size_t used_cnt;							/* Allocated pages. */
+	size_t dirty_cnt;							/* Pages set in dirty_map. */
+	struct arena *arenas;					/* Arena of each page that starts
+	                                 one, indexed like used_map. */
+	struct bitmap *zero_map;			/* Pages known to be zero: free pages
+	                                 that are, and pages in use that
+	                                 were when they were handed out. */
+	bool anon;										/* Pages are private anonymous memory
+	                                 of our own, zero when fresh or
+	                                 purged with MADV_DONTNEED. */
+	uint64_t dirty_since;					/* When DIRTY_CNT last became
+	                                 nonzero, in ms. */
 };
 
-static struct pool mem_pool;
+/* Our set of pools.  A pool is filled in before POOL_CNT counts
+   it and is never removed, so readers need no lock. */
+#define POOL_MAX 64
+_Static_assert(POOL_MAX <= CY_STATS_POOLS, "stats cannot hold every pool");
+static struct pool pools[POOL_MAX];     /* Pools. */
+static atomic_size_t pool_cnt;          /* Number of pools. */
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER; /* Serializes adding pools. */
+static int page_alloc = CY_PALLOC_BITMAP; /* Page allocator of every pool. */
+
+/* Huge page layout, chosen with CY_M_HUGEPAGE.
+   Each pool's pages start on a huge page boundary and are advised
+   with MADV_HUGEPAGE.  With the bitmap page allocator, each size
+   class packs its arenas into huge pages of its own (see
+   pool_scan_hpage()), and the decay policy only purges whole huge
+   pages, so that the kernel need not split them. */
+static bool hugepage;
+#define HPAGE_SIZE ((size_t) 2 << 20)
+#define HPAGE_PAGES (HPAGE_SIZE / PGSIZE)
+
+/* Pool of each 1 GB chunk of the address space, so that a page is
+   mapped to its pool in O(1): 0 if no pool is in the chunk, the
+   pool's index plus 1 if exactly one is, or POOL_SHARED if several
+   are, in which case the pools are searched.  Addresses above
+   2^ADDR_BITS are always searched. */
+#define CHUNK_SHIFT 30
+#define ADDR_BITS 48
+#define POOL_SHARED UINT8_MAX
+static _Atomic uint8_t pool_map[(size_t) 1 << (ADDR_BITS - CHUNK_SHIFT)];
+
+/* Address space reserved by init_growing_allocator() that is not
+   yet part of a pool.  It is mapped PROT_NONE; palloc_get_page()
+   turns it into pools of whole chunks as it runs out of pages, each
+   at least as big as all the ones before it, so that a reservation
+   of any size takes few of the POOL_MAX pools.  A pool's pages are
+   committed, that is made readable and writable, COMMIT_STEP bytes
+   at a time as they are handed out, and their arena entries with
+   them.  A pool takes at most POOL_PAGES_MAX pages, as many as its
+   page allocator can track.  Protected by pools_lock. */
+#define COMMIT_STEP HPAGE_SIZE
+#define POOL_PAGES_MAX ((size_t) 1 << 31)
+static struct
+{
+  uint8_t *start;               /* Start of the reservation. */
+  uint8_t *next;                /* Start of what is left. */
+  uint8_t *end;                 /* End of the reservation. */
+} reserved;
+
+/* Purging.
+
+   A page that is freed stays resident until it is purged, that is
+   handed back to the OS with madvise(), which leaves it mapped but
+   not backed by memory until it is next written.  Each pool marks
+   its free pages that may still be resident in DIRTY_MAP and purges
+   all of them at once when the oldest has been dirty for
+   PURGE_DECAY ms or when there are more than PURGE_DIRTY_MAX.
+   The check runs when pages are freed and, if started with
+   CY_M_PURGE_THREAD, periodically in the background; cy_heap_trim()
+   purges right away.  Set with cy_mallopt(). */
+static _Atomic size_t purge_decay = 10000;
+static _Atomic size_t purge_dirty_max = SIZE_MAX;
+static _Atomic int purge_advice = MADV_DONTNEED;
+
+/* Background purging thread. */
+static struct
+{
+  pthread_mutex_t lock;         /* Mutual exclusion. */
+  pthread_cond_t cond;          /* Signaled to wake the thread. */
+  pthread_t thread;             /* The thread, if RUNNING. */
+  bool running;                 /* Should the thread keep running? */
+} purger = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
 
 /* Descriptor */
 struct desc
 {
     size_t block_size;          /* Size of each element in bytes */
     size_t blocks_per_arena;    /* Number of blocks in an arena */
-    struct list free_list;      /* List of free blocks */
+    size_t align;               /* Alignment of every block. */
+    struct list partial;        /* Arenas with free blocks. */
+    struct list cached;         /* Empty arenas kept in arena_cache. */
+    size_t cached_cnt;          /* Number of arenas in CACHED. */
+    pthread_mutex_t lock;       /* Lock. */
+    _Atomic(struct arena *) remote_arenas; /* Arenas with remote frees. */
+    void *hpage;                /* Huge page new arenas are packed into. */
+    size_t arena_cnt;           /* Arenas with blocks out, not cached. */
+    size_t refills;             /* Thread cache refills. */
 };
 
 /* Magic number for detecting arena corruption. */
 #define ARENA_MAGIC 0x9a548eed
 
-/* Arena. */
+/* Arena.
+
+   The thread that last refilled its cache from an arena owns it.
+   Other threads free blocks of the arena by pushing them onto its
+   lock-free remote_free stack instead of their own caches.  The
+   first push onto an empty stack also queues the arena on its
+   descriptor's remote_arenas stack, and both stacks are emptied in
+   bulk by desc_drain().  Blocks waiting on remote_free still count
+   as allocated, so an arena is never released while any are
+   pending.
+
+   Each arena keeps its own free list, and is on its descriptor's
+   partial list whenever it has a block to hand out, so releasing
+   an empty arena is O(1) and allocations stay in the same page.
+   A new arena's blocks are handed out in order by bumping CARVED;
+   only blocks that have been freed are ever on the free list, so
+   the rest of the page is not touched until it is needed.
+
+   Arenas are not kept in the pages they describe but in their
+   pool's ARENAS, one for each page, so blocks fill whole pages and
+   a big block starts on a page boundary.  Only the entry of an
+   arena's first page is used, and its magic is cleared when the
+   arena is released, so a pointer that is not a block is caught
+   without reading the page it points into. */
 struct arena 
 {
     unsigned magic;             /* Always set to ARENA_MAGIC. */
+    _Atomic unsigned owner;     /* Owning thread's tcache id. */
+    _Atomic unsigned sampled;   /* Blocks in the heap profile. */
     struct desc *desc;          /* Owning descriptor, NULL for big block. */
     size_t free_cnt;            /* Free blocks; pages in big block. */
+    size_t carved;              /* Blocks ever handed out. */
+    void *pages;                /* First page; may come before the
+                                   block's in an aligned big block. */
+    struct list_elem *free_list; /* Free blocks, via free_elem.next. */
+    struct list_elem partial_elem; /* Element in desc's partial or
+                                      cached list. */
+    struct list_elem lru_elem;  /* Element in arena_cache's lru list. */
+    _Atomic(struct list_elem *) remote_free; /* Blocks freed remotely. */
+    struct arena *remote_next;  /* Next in desc's remote_arenas. */
+};
+
+/* Cache of empty arenas.
+
+   An arena that becomes empty is kept here instead of going back to
+   the page pool, so that a size class that keeps emptying and
+   refilling the same arena does not rescan the pool and rebuild the
+   arena every time.  Each descriptor keeps at most CLASS_MAX arenas
+   on its CACHED list and the cache as a whole at most MAX; beyond
+   that, the least recently emptied arena is released.  The cache's
+   lock protects the cached lists of every descriptor.  It is taken
+   after a descriptor's lock and before the pool's. */
+struct arena_cache
+{
+    pthread_mutex_t lock;       /* Mutual exclusion. */
+    struct list lru;            /* Cached arenas, most recent first. */
+    size_t cnt;                 /* Number of cached arenas. */
+    size_t max;                 /* High-water mark for CNT. */
+    size_t class_max;           /* High-water mark per descriptor. */
+};
+
+static struct arena_cache arena_cache =
+{
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .max = 64,
+  .class_max = 4,
 };
 
 /* Free block. */
@@ -42,22 +215,241 @@ struct block
 };
 
 /* Our set of descriptors. */
-static struct desc descs[100];   /* Descriptors. */
+#define DESC_MAX 100
+_Static_assert(DESC_MAX + 2 <= CY_STATS_CLASSES,
+               "stats cannot hold every class");
+static struct desc descs[DESC_MAX];   /* Descriptors. */
 static size_t desc_cnt;         /* Number of descriptors. */
 static struct desc requested_desc;	/* Descriptor for frequently requested size. */
 
+/* Largest request a size class serves. */
+#define SMALL_MAX (PGSIZE / 2)
+
+/* Index of the descriptor for each request size up to SMALL_MAX,
+   DESC_MAX for requested_desc, or CLASS_BIG for sizes that get a
+   big block.  Indexed by the size itself, so that an exact
+   requested_size keeps its own class. */
+#define CLASS_BIG UINT8_MAX
+static uint8_t size_classes[SMALL_MAX + 1];
+
+/* Size class layout, chosen before init.
+
+   CLASS_SPACING, set with CY_M_SIZE_CLASSES, puts one class at each
+   power of two from 16 bytes to SMALL_MAX, or four per doubling.
+   On top of those, init_descs() adds up to HOT_MAX classes of the
+   exact sizes, rounded up to HOT_ALIGN, that save the most memory
+   for the requests in SIZE_PROFILE, which cy_size_profile_load()
+   fills in from a profile saved by cy_size_profile_save(). */
+#define HOT_MAX 8
+#define HOT_ALIGN 16
+static int class_spacing = CY_CLASSES_POW2;
+static size_t size_profile[SMALL_MAX + 1];
+
+/* Request size sampling, turned on with CY_M_SIZE_SAMPLE: one in
+   every SIZE_SAMPLE requests is counted in SIZE_HIST, by its size,
+   or in SIZE_HIST[0] if it gets a big block. */
+static _Atomic size_t size_sample;
+static _Atomic size_t size_hist[SMALL_MAX + 1];
+
+/* Sampling heap profiler, turned on with CY_M_PROF_RATE.
+
+   Each thread counts down the bytes it allocates in its cache's
+   prof_left.  When that runs out, the block being handed out is
+   recorded with its call stack in PROF's table, keyed by address,
+   and the next count is drawn from an exponential distribution of
+   mean PROF_RATE, so that every byte is as likely to be sampled.
+   While the profiler is off, a thread checks again every
+   PROF_RECHECK bytes.  An arena's SAMPLED counts its blocks in the
+   table, so freeing a block of any other arena looks nothing up. */
+#define PROF_DEPTH 32
+#define PROF_BUCKETS 1024
+#define PROF_RECHECK ((int64_t) 1 << 26)
+
+/* A sampled block. */
+struct prof_sample
+{
+    struct prof_sample *next;   /* Next in bucket or free list. */
+    void *block;                /* The block. */
+    size_t size;                /* Bytes asked for. */
+    size_t rate;                /* PROF_RATE it was sampled at. */
+    int depth;                  /* Frames in STACK. */
+    void *stack[PROF_DEPTH];    /* Return addresses, innermost first. */
+};
+
+static _Atomic size_t prof_rate;
+static _Atomic size_t prof_live;        /* Samples in the table. */
+static struct
+{
+  pthread_mutex_t lock;         /* Mutual exclusion. */
+  struct prof_sample *buckets[PROF_BUCKETS]; /* Samples by address. */
+  struct prof_sample *free_list; /* Unused samples. */
+  size_t rate;                  /* PROF_RATE of the latest sample. */
+} prof = { PTHREAD_MUTEX_INITIALIZER };
+
+/* Allocation trace recorder, started with cy_trace_start().
+
+   Each thread encodes its events into a trace_buf of its own, taken
+   from the pools when it first records one, and writes them to
+   TRACE's file as one chunk when the buffer fills up, when the
+   thread exits and when the trace stops.  So a buffer's lock is only
+   contended while cy_trace_stop() flushes it.  Locks are taken in
+   the order trace_reg's, a buffer's, TRACE's. */
+#define TRACE_BUF_PAGES 16
+#define TRACE_EVENT_MAX 48
+
+/* A thread's trace events not yet written. */
+struct trace_buf
+{
+    pthread_mutex_t lock;       /* Mutual exclusion. */
+    struct list_elem elem;      /* Element in trace_reg's list. */
+    unsigned thread;            /* Thread number in the trace. */
+    unsigned session;           /* Trace the events belong to. */
+    uint64_t ref_time;          /* Time the first event counts from. */
+    uint64_t last_time;         /* Time of the latest event. */
+    uintptr_t last_addr;        /* Address of the latest event. */
+    size_t len;                 /* Bytes in DATA. */
+    uint8_t data[];             /* Encoded events. */
+};
+
+/* The trace being recorded. */
+static struct
+{
+  pthread_mutex_t lock;         /* Mutual exclusion. */
+  FILE *file;                   /* Trace file, if recording. */
+  _Atomic bool on;              /* Are events being recorded? */
+  _Atomic unsigned session;     /* Incremented at each start. */
+  _Atomic uint64_t start;       /* now_ns() at the start. */
+} trace = { PTHREAD_MUTEX_INITIALIZER };
+
+/* Every thread's trace buffer. */
+static struct
+{
+  pthread_mutex_t lock;         /* Mutual exclusion. */
+  struct list bufs;             /* Buffers. */
+  unsigned threads;             /* Buffers numbered so far. */
+} trace_reg = { PTHREAD_MUTEX_INITIALIZER };
+
+/* Blocks moved between a thread's cache and a descriptor at once. */
+#define TCACHE_BATCH 32
+
+/* Most blocks a thread's cache holds for one descriptor. */
+#define TCACHE_MAX (2 * TCACHE_BATCH)
+
+/* Blocks of one size class a thread has allocated and freed.
+   Only the owning thread writes them, without atomic
+   read-modify-write, and cy_malloc_stats() adds them up. */
+struct tcache_stats
+{
+    _Atomic size_t allocs;      /* Blocks handed out. */
+    _Atomic size_t frees;       /* Blocks given back. */
+};
+
+/* Free blocks of one descriptor cached by a thread, chained
+   through free_elem.next, and the thread's counters for the
+   descriptor, next to them so as to share their cache line. */
+struct tcache_bin
+{
+    struct list_elem *head;     /* First cached block. */
+    size_t cnt;                 /* Number of cached blocks. */
+    struct tcache_stats stats;  /* Counters. */
+};
+
+/* Index of the counters of big blocks in a thread's cache. */
+#define STATS_BIG (DESC_MAX + 1)
+
+/* Per-thread cache.  Blocks in it still count as allocated in
+   their arenas, so only the owning thread ever touches it.
+   bins[DESC_MAX] caches blocks of requested_desc. */
+struct tcache
+{
+    unsigned id;                /* Nonzero once registered. */
+    size_t sample_left;         /* Requests until the next sample. */
+    int64_t prof_left;          /* Bytes until the next heap sample. */
+    uint64_t prof_rand;         /* Random state for PROF_LEFT. */
+    bool tracing;               /* Inside a traced call? */
+    struct trace_buf *trace;    /* Trace events, once it has any. */
+    struct tcache_bin bins[STATS_BIG + 1]; /* Last, big blocks' counters. */
+    struct list_elem stats_elem; /* Element in stats_reg's list. */
+};
+
+static __thread struct tcache tcache;
+static atomic_uint tcache_ids;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* Every registered thread cache, for cy_malloc_stats() to add up
+   their counters, and the counters of threads that have exited. */
+static struct
+{
+  pthread_mutex_t lock;         /* Mutual exclusion. */
+  struct list tcaches;          /* Registered caches. */
+  size_t allocs[STATS_BIG + 1]; /* Of exited threads. */
+  size_t frees[STATS_BIG + 1];  /* Of exited threads. */
+} stats_reg = { PTHREAD_MUTEX_INITIALIZER };
+
+/* Adds CNT to counter C, which only this thread writes. */
+static inline void stats_add(_Atomic size_t *c, size_t cnt)
+{
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + cnt,
+                        memory_order_relaxed);
+}
+
 static struct arena *block_to_arena (struct block *);
+static struct arena *lookup_arena (const void *);
+static struct arena *page_to_arena (const void *);
+static void arena_free (struct arena *);
 static struct block *arena_to_block (struct arena *, size_t idx);
+static void *desc_alloc(struct desc *);
+static struct desc *desc_aligned(size_t n, size_t align);
+static void *big_block_alloc(size_t n, size_t align);
+static bool tcache_refill(struct desc *, struct tcache_bin *, size_t cnt);
+static void tcache_flush(struct desc *, struct tcache_bin *, size_t cnt);
+static void remote_free(struct desc *, struct arena *, struct block *first,
+                        struct block *last);
+static void desc_drain(struct desc *);
+static void descs_drain(void);
+static void desc_free_block(struct desc *, struct block *);
+static void desc_free_chain(struct desc *, struct arena *, struct block *first,
+                            struct block *last, size_t cnt);
+static void arena_cache_put(struct desc *, struct arena *);
+static struct arena *arena_cache_get(struct desc *);
+
+static void arena_cache_trim(size_t max);
+static size_t pool_decay(struct pool *, uint64_t now);
+static size_t purge_pools(bool all);
 
-static void init_pool(struct pool *p, void *base, size_t page_cnt);
+static void *arena_page_get(struct desc *);
+static bool pool_commit(struct pool *, void *end);
+static void pool_take(struct pool *, size_t idx, size_t page_cnt);
+static void pool_give(struct pool *, size_t idx, size_t page_cnt, uint64_t now);
+static bool palloc_resize_page(void *pages, size_t old_cnt, size_t new_cnt);
+static void palloc_zero(void *start, size_t len);
+
+static bool init_pool(struct pool *p, void *base, size_t page_cnt);
+static void init_descs(size_t requested_size);
+static void init_desc(struct desc *, size_t block_size);
+static size_t init_class_sizes(size_t *sizes);
+static void size_sample_note(size_t n, size_t cnt);
+static void *prof_alloc(size_t n, size_t align, void *ret);
+static void prof_batch(size_t n, size_t cnt, void **p, void *ret);
+static void prof_free(struct arena *, void *);
+static inline bool trace_wanted(void);
+static void trace_event(int op, const void *old, const void *new, size_t n,
+                        size_t align);
+static void trace_leave(int op, const void *old, const void *new, size_t n,
+                        size_t align);
+static void trace_flush(struct trace_buf *);
+static uint64_t now_ns(void);
+static void init_size_classes(void);
 
 /* The start address, end address of the memory pool is given.
    The size that will be frequently requested is given as requested_size.
    This will be treated by the requested_desc descriptor.
 
    Divides the given address area to pages with PGSIZE. 
-	 With the calculated free pages, it initializes the memory pool.*/
-void init_memory_allocator(uint32_t start_addr, uint32_t end_addr, uint32_t requested_size)
+	 With the calculated free pages, it initializes the memory pool.
+	 More regions can be added later with cy_add_region(). */
+void init_memory_allocator(uintptr_t start_addr, uintptr_t end_addr, size_t requested_size)
 {
 	/* Error handling. */
 	if (start_addr >= end_addr) {
@@ -65,223 +457,2569 @@ void init_memory_allocator(uint32_t start_addr, uint32_t end_addr, uint32_t requ
     return;
   }
 
-	/* Calculates number of free pages and initializes pool. */
-	size_t free_pages = (end_addr - start_addr) / PGSIZE;
-	init_pool(&mem_pool, ((void *)start_addr), free_pages);
+	/* Initializes the first pool. */
+	if (!cy_add_region((void *) start_addr, end_addr - start_addr))
+	  return;
+
+	init_descs(requested_size);
+}
+
+/* Initializes the allocator without any memory, reserving
+   MAX_SIZE bytes of address space for it instead.  The pool grows
+   into the reservation as memory is requested, so nothing but
+   address space is used up front, however big MAX_SIZE is.
+   The size that will be frequently requested is given as
+   requested_size, as for init_memory_allocator(). */
+void init_growing_allocator(size_t max_size, size_t requested_size)
+{
+  size_t len = ROUND_UP(max_size, (size_t) 1 << CHUNK_SHIFT);
+  uint8_t *map, *start;
+
+  /* Error handling. */
+  if (max_size == 0 || len < max_size) {
+    printf("[ERROR] bad max_size");
+    return;
+  }
+
+  /* Reserve one chunk more than asked for, so that the pools can
+     start on a chunk boundary and have pool_map to themselves. */
+  map = mmap(NULL, len + ((size_t) 1 << CHUNK_SHIFT), PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    printf("[ERROR] cannot reserve %zu bytes\n", len);
+    return;
+  }
+  start = (uint8_t *) ROUND_UP((uintptr_t) map, (size_t) 1 << CHUNK_SHIFT);
+  if (start > map)
+    munmap(map, start - map);
+  munmap(start + len, map + ((size_t) 1 << CHUNK_SHIFT) - start);
+
+  pthread_mutex_lock(&pools_lock);
+  reserved.start = reserved.next = start;
+  reserved.end = start + len;
+  pthread_mutex_unlock(&pools_lock);
+
+  init_descs(requested_size);
+}
 
+/* Initializes malloc() descriptors, with requested_desc for
+   REQUESTED_SIZE. */
+static void init_descs(size_t requested_size)
+{
+	list_init(&arena_cache.lru);
 
 	/* Initializes malloc() descriptors. */
-	size_t block_size;
+	size_t sizes[DESC_MAX];
+	size_t size_cnt = init_class_sizes(sizes), i;
 	bool requested_size_in_desc = false;
-	for (block_size = 16; block_size < PGSIZE / 2; block_size *= 2) {
-	  if (block_size == requested_size)
+	for (i = 0; i < size_cnt; i++) {
+	  if (sizes[i] == requested_size)
 	    requested_size_in_desc = true;
 	  struct desc *d = &descs[desc_cnt++];
 	  assert(desc_cnt <= sizeof descs / sizeof *descs);
-	  d->block_size = block_size;
-	  d->blocks_per_arena = (PGSIZE - sizeof (struct arena)) / block_size;
-	  list_init(&d->free_list);
+	  init_desc(d, sizes[i]);
 	}
 
 	/* Initializes descriptor for requested_size. */
-	if (requested_size == 0 || requested_size_in_desc)
-	  return;
-
-  /* Error handling */
-  if (requested_size >= PGSIZE/2) {
-    printf("[ERROR] requested_size is equal or bigger than PGSIZE/2");
-    return;
-  }	
-	/* Initialize the requested_desc for blocks smaller than PGSIZE/2, 
-     and for the size that is not handled by desc */
-	else if (requested_size < PGSIZE/2) {
-	  struct desc *d = &requested_desc;
-	  d->block_size = (size_t)requested_size;
-	  d->blocks_per_arena = (PGSIZE - sizeof (struct arena)) / requested_size;
-	  list_init(&d->free_list);
+	if (requested_size != 0 && !requested_size_in_desc) {
+    /* Error handling */
+    if (requested_size > SMALL_MAX)
+      printf("[ERROR] requested_size is bigger than SMALL_MAX");
+	  /* Initialize the requested_desc for blocks up to SMALL_MAX, 
+       and for the size that is not handled by desc */
+	  else
+	    init_desc(&requested_desc, requested_size);
 	}
+
+	init_size_classes();
 }
 
-/* Obtains and returns a new block of at least n bytes. 
-   Returns a null pointer if memory is not available. */
-void *cy_malloc(size_t n) 
+/* Stores the block size of each size class in SIZES, in increasing
+   order, and returns how many there are: those of CLASS_SPACING,
+   and then one at a time the hot size that saves the most bytes
+   for the requests in size_profile, as long as it is worth an
+   arena of its own, that is it serves at least 1% of them. */
+static size_t init_class_sizes(size_t *sizes)
 {
-  struct desc *d;
-  struct block *b;
-  struct arena *a;
+  size_t cnt = 0, total = 0, hot, n, i;
+  size_t block_size;
 
-  /* A null pointer satisfies a request for 0 bytes. */
-  if (n == 0)
-    return NULL;
-	
-  if (n == requested_desc.block_size)
-    d = &requested_desc;
+  for (block_size = 16; block_size <= SMALL_MAX; ) {
+    sizes[cnt++] = block_size;
+    if (class_spacing == CY_CLASSES_POW2)
+      block_size *= 2;
+    else {
+      /* Step by a quarter of the power of two below, but by no less
+         than 16 bytes. */
+      size_t pow2 = 16;
 
-  /* Find the smallest descriptor that satisfies a SIZE-byte
-     request. */
-  else {
-    for (d = descs; d < descs + desc_cnt; d++)
-      if (d->block_size >= n)
-        break;
+      while (pow2 * 2 <= block_size)
+        pow2 *= 2;
+      block_size += pow2 / 4 > 16 ? pow2 / 4 : 16;
+    }
   }
-	
-  /* Big Block */
-  if (d == descs + desc_cnt) 
-  {
-    /* SIZE is too big for any descriptor.
-       Allocate enough pages to hold SIZE plus an arena.*/
-    size_t page_cnt = DIV_ROUND_UP(n + sizeof *a, PGSIZE);
-    a = palloc_get_page(page_cnt); 
-    if (a == NULL)
-      return NULL;
 
-    /* Initialize the arena to indicate a big block of PAGE_CNT
-       pages, and return it.*/
-    a->magic = ARENA_MAGIC;
-    a->desc = NULL;
-    a->free_cnt = page_cnt;
-    return a + 1;
+  for (n = 1; n <= SMALL_MAX; n++)
+    total += size_profile[n];
+  for (hot = 0; hot < HOT_MAX && cnt < DESC_MAX; hot++) {
+    size_t best = 0, best_gain = 0, best_idx = 0;
+
+    /* A class of SIZE, between classes LO and HI, would serve the
+       requests above LO and up to SIZE in SIZE bytes instead of
+       HI. */
+    for (i = 0; i < cnt; i++) {
+      size_t lo = i == 0 ? 0 : sizes[i - 1], size;
+      size_t served = 0;
+
+      for (size = ROUND_UP(lo + 1, HOT_ALIGN); size < sizes[i];
+           size += HOT_ALIGN) {
+        for (n = size - HOT_ALIGN + 1; n <= size; n++)
+          served += n > lo ? size_profile[n] : 0;
+        if (served * 100 >= total && served > 0
+            && served * (sizes[i] - size) > best_gain) {
+          best = size;
+          best_gain = served * (sizes[i] - size);
+          best_idx = i;
+        }
+      }
+    }
+    if (best == 0)
+      break;
+    memmove(sizes + best_idx + 1, sizes + best_idx,
+            (cnt - best_idx) * sizeof *sizes);
+    sizes[best_idx] = best;
+    cnt++;
   }
+  return cnt;
+}
 
-  /* If the free list is empty, create a new area */
-  if (list_empty(&d->free_list))
-  {
-    size_t i;
+/* Initializes descriptor D for blocks of BLOCK_SIZE bytes.  The
+   blocks fill the arena's page from its start, so they are aligned
+   to the largest power of two dividing BLOCK_SIZE, and every
+   power-of-two class is aligned to its own size. */
+static void init_desc(struct desc *d, size_t block_size)
+{
+  d->block_size = block_size;
+  d->align = block_size & -block_size;
+  d->blocks_per_arena = PGSIZE / block_size;
+  list_init(&d->partial);
+  list_init(&d->cached);
+  d->cached_cnt = 0;
+  pthread_mutex_init(&d->lock, NULL);
+  atomic_init(&d->remote_arenas, NULL);
+  d->hpage = NULL;
+  d->arena_cnt = 0;
+  d->refills = 0;
+}
 
-  	/* Allocate a page. */
-	  a = palloc_get_page(1);
-    if (a == NULL)
-      return NULL; 
+/* Fills size_classes with the smallest descriptor that satisfies
+   each request size. */
+static void init_size_classes(void)
+{
+  size_t n, i;
 
-    /* Initialize arena and add its blocks to the free list. */
-    a->magic = ARENA_MAGIC;
-    a->desc = d;
-    a->free_cnt = d->blocks_per_arena;
-    for (i = 0; i < d->blocks_per_arena; i++) {
-      struct block *b = arena_to_block (a, i);
-      list_push_back(&d->free_list, &b->free_elem);
-    }
+  for (n = 1; n <= SMALL_MAX; n++) {
+    size_classes[n] = CLASS_BIG;
+    for (i = 0; i < desc_cnt; i++)
+      if (descs[i].block_size >= n) {
+        size_classes[n] = i;
+        break;
+      }
+    if (requested_desc.block_size >= n
+        && (size_classes[n] == CLASS_BIG
+            || requested_desc.block_size < descs[size_classes[n]].block_size))
+      size_classes[n] = DESC_MAX;
   }
+}
 
-  /* Get a block from free list and return it. */
-  b = list_entry(list_pop_front (&d->free_list), struct block, free_elem);
-  a = block_to_arena(b);
-  a->free_cnt--;
-  return b;
-}    
+/* Returns the index of D's bin in a thread's cache. */
+static inline size_t desc_idx(struct desc *d)
+{
+  return d == &requested_desc ? DESC_MAX : (size_t) (d - descs);
+}
 
-/* Frees block p, which must have been previously allocated with malloc(). */
-void cy_free(void *p)
+/* Flushes every bin of the exiting thread's cache. */
+static void tcache_destroy(void *aux)
 {
-  /* Error handling */
-  if (p == NULL) {
-    printf("[ERROR] Failed to free %p\n", p);
+  struct tcache *tc = aux;
+  size_t i;
+
+  for (i = 0; i < desc_cnt; i++)
+    tcache_flush(&descs[i], &tc->bins[i], tc->bins[i].cnt);
+  tcache_flush(&requested_desc, &tc->bins[DESC_MAX], tc->bins[DESC_MAX].cnt);
+
+  /* Take back the blocks other threads freed in its arenas, which
+     would otherwise wait until their size classes refill. */
+  descs_drain();
+
+  /* Write out its trace events. */
+  if (tc->trace != NULL) {
+    pthread_mutex_lock(&trace_reg.lock);
+    list_remove(&tc->trace->elem);
+    pthread_mutex_lock(&tc->trace->lock);
+    trace_flush(tc->trace);
+    pthread_mutex_unlock(&tc->trace->lock);
+    pthread_mutex_unlock(&trace_reg.lock);
+    palloc_free_page(tc->trace, TRACE_BUF_PAGES);
+    tc->trace = NULL;
+  }
+
+  /* Keep its counters. */
+  pthread_mutex_lock(&stats_reg.lock);
+  list_remove(&tc->stats_elem);
+  for (i = 0; i <= STATS_BIG; i++) {
+    stats_reg.allocs[i] += atomic_load(&tc->bins[i].stats.allocs);
+    stats_reg.frees[i] += atomic_load(&tc->bins[i].stats.frees);
+  }
+  pthread_mutex_unlock(&stats_reg.lock);
+}
+
+static void tcache_key_create(void)
+{
+  pthread_key_create(&tcache_key, tcache_destroy);
+  list_init(&stats_reg.tcaches);
+  list_init(&trace_reg.bufs);
+}
+
+/* Arranges for this thread's cache to be flushed when it exits. */
+static void tcache_register(void)
+{
+  pthread_once(&tcache_once, tcache_key_create);
+  pthread_setspecific(tcache_key, &tcache);
+  tcache.id = atomic_fetch_add(&tcache_ids, 1) + 1;
+  pthread_mutex_lock(&stats_reg.lock);
+  list_push_back(&stats_reg.tcaches, &tcache.stats_elem);
+  pthread_mutex_unlock(&stats_reg.lock);
+}
+
+/* Counts CNT requests of N bytes towards the next sample, taking
+   one sample every size_sample requests. */
+static void size_sample_note(size_t n, size_t cnt)
+{
+  size_t period = atomic_load_explicit(&size_sample, memory_order_relaxed);
+  size_t samples;
+
+  if (cnt < tcache.sample_left) {
+    tcache.sample_left -= cnt;
     return;
   }
+  cnt -= tcache.sample_left;
+  samples = 1 + cnt / period;
+  tcache.sample_left = period - cnt % period;
+  atomic_fetch_add_explicit(&size_hist[n > SMALL_MAX ? 0 : n], samples,
+                            memory_order_relaxed);
+}
 
-  struct block *b = p;
-  struct arena *a = block_to_arena(b);
-  struct desc *d = a->desc;
+/* Writes the request sizes sampled so far to the file at PATH, one
+   "SIZE COUNT" line per size, for cy_size_profile_load().  Returns
+   1 on success, 0 if the file cannot be written. */
+int cy_size_profile_save(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  size_t n;
+  int success;
 
-  /* Normal Block */
-  if (d != NULL) {
-    /* Add block to free list. */
-    list_push_front(&d->free_list, &b->free_elem);
-
-    /* If the arena is now entirely unused, free it. */
-    if (++a->free_cnt >= d->blocks_per_arena) {
-      size_t i;
-
-      if (a->free_cnt != d->blocks_per_arena)
-        return;
-      for (i = 0; i < d->blocks_per_arena; i++) {
-        struct block *b = arena_to_block (a, i);
-        list_remove(&b->free_elem);
-      }
-      palloc_free_page(a, 1);
-    }
+  if (f == NULL) {
+    printf("[ERROR] cannot write %s\n", path);
+    return 0;
   }
+  fprintf(f, "# cy_malloc size profile: size count\n");
+  for (n = 1; n <= SMALL_MAX; n++) {
+    size_t cnt = atomic_load_explicit(&size_hist[n], memory_order_relaxed);
 
-  /* Big Block */
-  else {
-    palloc_free_page(a, a->free_cnt);
-    return;
+    if (cnt != 0)
+      fprintf(f, "%zu %zu\n", n, cnt);
   }
-}                        
+  success = !ferror(f);
+  return fclose(f) == 0 && success;
+}
 
-/* Initializes pool P */
-static void init_pool(struct pool *p, void *base, size_t page_cnt)
+/* Reads a profile saved by cy_size_profile_save() from the file at
+   PATH, for the size classes built at init to fit.  Returns 1 on
+   success, 0 if the allocator is already initialized or the file
+   cannot be read. */
+int cy_size_profile_load(const char *path)
 {
-  /* We'll put the pool's used_map at its base. 
-	 Calculate the space needed for the bitmap
-	 and subtract it from the pool's size. */
-  size_t bm_pages = DIV_ROUND_UP(bitmap_buf_size (page_cnt), PGSIZE);
-  /* Error handling */
-  if (bm_pages > page_cnt) {
-  	printf("Not enough memory for bitmap.");
-	  return;
+  char line[64];
+  FILE *f;
+
+  if (desc_cnt != 0)
+    return 0;
+  f = fopen(path, "r");
+  if (f == NULL) {
+    printf("[ERROR] cannot read %s\n", path);
+    return 0;
   }
-  page_cnt -= bm_pages; 
-	
-  p->used_map = bitmap_create_in_buf(page_cnt, base, bm_pages * PGSIZE);
-  p->base = base + bm_pages * PGSIZE;
+  memset(size_profile, 0, sizeof size_profile);
+  while (fgets(line, sizeof line, f) != NULL) {
+    size_t n, cnt;
+
+    if (line[0] != '#' && sscanf(line, "%zu %zu", &n, &cnt) == 2
+        && n >= 1 && n <= SMALL_MAX)
+      size_profile[n] += cnt;
+  }
+  fclose(f);
+  return 1;
 }
 
-/* Obtains and returns a group of page_cnt contiguous free pages.
-   If too few pages are available, returns a null pointer. */
-void *palloc_get_page(size_t page_cnt)
+/* Returns the number of bytes to allocate before the next heap
+   profile sample, drawn from an exponential distribution of mean
+   RATE, or PROF_RECHECK if RATE is 0. */
+static int64_t prof_interval(size_t rate)
 {
-  struct pool *pool = &mem_pool;
-  void *pages;
-  size_t page_idx;
+  uint64_t x = tcache.prof_rand;
+  double bytes;
 
-  if (page_cnt == 0)
-  	return NULL;
+  if (rate == 0)
+    return PROF_RECHECK;
+
+  /* xorshift64*, seeded from the thread's cache address. */
+  if (x == 0)
+    x = (uintptr_t) &tcache * 0x9e3779b97f4a7c15ull | 1;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  tcache.prof_rand = x;
+  bytes = -log(((x * 0x2545f4914f6cdd1dull >> 11) + 1) * 0x1p-53) * rate;
+  return bytes < INT64_MAX / 2 ? (int64_t) bytes : INT64_MAX / 2;
+}
 
-  page_idx = bitmap_scan_and_flip(pool->used_map, 0, page_cnt, false);
+/* Records block P of N bytes, sampled at RATE, in the heap profile
+   with the call stack from the frame that returns to RET, or the
+   whole stack if RET is not on it. */
+static void prof_record(void *p, size_t n, size_t rate, void *ret)
+{
+  void *stack[PROF_DEPTH + 8];
+  struct prof_sample *s;
+  struct arena *a;
+  int depth = backtrace(stack, PROF_DEPTH + 8);
+  int top;
 
-  if (page_idx != BITMAP_ERROR) {
-    pages = pool->base + (PGSIZE * page_idx);
+  /* Leave out the allocator's own frames. */
+  for (top = 0; top < depth && stack[top] != ret; top++)
+    continue;
+  if (top == depth)
+    top = 0;
+
+  pthread_mutex_lock(&prof.lock);
+  if (prof.free_list == NULL) {
+    struct prof_sample *page = palloc_get_page(1);
+    size_t i;
+
+    if (page == NULL) {
+      pthread_mutex_unlock(&prof.lock);
+      return;
+    }
+    for (i = 0; i < PGSIZE / sizeof *page; i++) {
+      page[i].next = prof.free_list;
+      prof.free_list = &page[i];
+    }
   }
+  s = prof.free_list;
+  prof.free_list = s->next;
+
+  s->block = p;
+  s->size = n;
+  s->rate = rate;
+  s->depth = depth - top < PROF_DEPTH ? depth - top : PROF_DEPTH;
+  memcpy(s->stack, stack + top, s->depth * sizeof *stack);
+  s->next = prof.buckets[(uintptr_t) p / 16 % PROF_BUCKETS];
+  prof.buckets[(uintptr_t) p / 16 % PROF_BUCKETS] = s;
+  prof.rate = rate;
+
+  a = block_to_arena(p);
+  atomic_fetch_add_explicit(&a->sampled, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&prof_live, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&prof.lock);
+}
+
+/* Obtains a block of N bytes aligned to ALIGN, or as cy_malloc()
+   does if ALIGN is 0, for a caller whose count of bytes until the
+   next heap profile sample has run out, and records it.  RET is the
+   caller's return address. */
+static void *prof_alloc(size_t n, size_t align, void *ret)
+{
+  size_t rate = atomic_load_explicit(&prof_rate, memory_order_relaxed);
+  struct desc *d;
+  void *p;
+
+  tcache.prof_left = prof_interval(rate);
+  if (align != 0)
+    d = desc_aligned(n, align);
+  else if (n <= SMALL_MAX && size_classes[n] != CLASS_BIG)
+    d = size_classes[n] == DESC_MAX ? &requested_desc : &descs[size_classes[n]];
+  else
+    d = NULL;
+  p = d != NULL ? desc_alloc(d) : big_block_alloc(n, align);
+  if (p != NULL && rate != 0)
+    prof_record(p, n, rate, ret);
+  return p;
+}
+
+/* Counts the CNT blocks of N bytes in P towards the next heap
+   profile sample one by one, recording the ones it falls on, for a
+   caller that has counted them all at once and run out.  RET is the
+   caller's return address. */
+static void prof_batch(size_t n, size_t cnt, void **p, void *ret)
+{
+  size_t rate = atomic_load_explicit(&prof_rate, memory_order_relaxed);
+  size_t i;
+
+  tcache.prof_left += (int64_t) (n * cnt);
+  for (i = 0; i < cnt; i++)
+    if ((tcache.prof_left -= n) < 0) {
+      tcache.prof_left = prof_interval(rate);
+      if (rate != 0)
+        prof_record(p[i], n, rate, ret);
+    }
+}
+
+/* Drops block P of arena A from the heap profile, if it is there. */
+static void prof_free(struct arena *a, void *p)
+{
+  struct prof_sample **sp;
+
+  pthread_mutex_lock(&prof.lock);
+  for (sp = &prof.buckets[(uintptr_t) p / 16 % PROF_BUCKETS]; *sp != NULL;
+       sp = &(*sp)->next)
+    if ((*sp)->block == p) {
+      struct prof_sample *s = *sp;
+
+      *sp = s->next;
+      s->next = prof.free_list;
+      prof.free_list = s;
+      atomic_fetch_sub_explicit(&a->sampled, 1, memory_order_relaxed);
+      atomic_fetch_sub_explicit(&prof_live, 1, memory_order_relaxed);
+      break;
+    }
+  pthread_mutex_unlock(&prof.lock);
+}
+
+/* Writes the name of the function return address PC is in to F, or
+   its object file and offset if the function has no dynamic
+   symbol. */
+static void prof_print_frame(FILE *f, void *pc)
+{
+  Dl_info info;
+
+  if (dladdr((uint8_t *) pc - 1, &info) == 0 || info.dli_fname == NULL)
+    fprintf(f, "0x%" PRIxPTR, (uintptr_t) pc);
+  else if (info.dli_sname != NULL)
+    fputs(info.dli_sname, f);
   else {
-    pages = NULL;
+    const char *name = strrchr(info.dli_fname, '/');
+
+    fprintf(f, "%s+0x%tx", name != NULL ? name + 1 : info.dli_fname,
+            (uint8_t *) pc - (uint8_t *) info.dli_fbase);
   }
+}
 
-  return pages;
+/* Writes the blocks the heap profiler has sampled and that have not
+   been freed to F: as a legacy pprof heap profile, which pprof
+   scales up by the sampling rate itself, if FORMAT is CY_PROF_PPROF,
+   or as folded stacks for flamegraph.pl, each weighted by the bytes
+   it stands for, if it is CY_PROF_FOLDED.  Returns 1 on success, 0
+   if FORMAT is unknown or F cannot be written. */
+int cy_heap_profile_print(FILE *f, int format)
+{
+  struct prof_sample *s;
+  size_t cnt = 0, bytes = 0;
+  size_t i;
+  int j;
+
+  if (format != CY_PROF_PPROF && format != CY_PROF_FOLDED)
+    return 0;
+
+  pthread_mutex_lock(&prof.lock);
+  if (format == CY_PROF_PPROF) {
+    for (i = 0; i < PROF_BUCKETS; i++)
+      for (s = prof.buckets[i]; s != NULL; s = s->next) {
+        cnt++;
+        bytes += s->size;
+      }
+    fprintf(f, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+            cnt, bytes, cnt, bytes, prof.rate);
+  }
+  for (i = 0; i < PROF_BUCKETS; i++)
+    for (s = prof.buckets[i]; s != NULL; s = s->next) {
+      if (format == CY_PROF_PPROF) {
+        fprintf(f, "%6d: %8zu [%6d: %8zu] @", 1, s->size, 1, s->size);
+        for (j = 0; j < s->depth; j++)
+          fprintf(f, " 0x%" PRIxPTR, (uintptr_t) s->stack[j]);
+      }
+      else {
+        /* A block of N bytes is sampled with probability
+           1 - exp(-N / rate). */
+        double weight = s->size / -expm1(-(double) s->size / s->rate);
+
+        for (j = s->depth - 1; j >= 0; j--) {
+          prof_print_frame(f, s->stack[j]);
+          fputc(j > 0 ? ';' : ' ', f);
+        }
+        fprintf(f, "%.0f", weight);
+      }
+      fputc('\n', f);
+    }
+  pthread_mutex_unlock(&prof.lock);
+
+  /* pprof symbolizes the addresses with the mappings. */
+  if (format == CY_PROF_PPROF) {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    char buf[4096];
+    size_t len;
+
+    fprintf(f, "\nMAPPED_LIBRARIES:\n");
+    if (maps != NULL) {
+      while ((len = fread(buf, 1, sizeof buf, maps)) > 0)
+        fwrite(buf, 1, len, f);
+      fclose(maps);
+    }
+  }
+  return !ferror(f);
 }
 
-/* Frees the page_cnt pages starting at pages. */
-void palloc_free_page(void *pages, size_t page_cnt)
+/* Returns true if this call should be traced: a trace is being
+   recorded and the call is not made by another traced call. */
+static inline bool trace_wanted(void)
 {
-  struct pool *pool;
-  size_t page_idx;
+  return atomic_load_explicit(&trace.on, memory_order_relaxed)
+         && !tcache.tracing;
+}
 
-  assert(pg_ofs(pages) == 0);
-  if (pages == NULL || page_cnt == 0)
+/* Appends X to P as an unsigned LEB128 varint.  Returns the end. */
+static uint8_t *trace_varint(uint8_t *p, uint64_t x)
+{
+  for (; x >= 0x80; x >>= 7)
+    *p++ = (uint8_t) x | 0x80;
+  *p++ = x;
+  return p;
+}
+
+/* Appends address A to P as the zigzag difference from the address
+   of B's latest event.  Returns the end. */
+static uint8_t *trace_addr(struct trace_buf *b, uint8_t *p, const void *a)
+{
+  int64_t d = (int64_t) ((uintptr_t) a - b->last_addr);
+
+  b->last_addr = (uintptr_t) a;
+  return trace_varint(p, (uint64_t) d << 1 ^ (uint64_t) (d >> 63));
+}
+
+/* Writes B's events to the trace file as one chunk, if they belong
+   to the trace being recorded, and empties B.  B's lock must be
+   held. */
+static void trace_flush(struct trace_buf *b)
+{
+  uint8_t head[3 * 10], *end;
+
+  if (b->len == 0)
+    return;
+  end = trace_varint(head, b->thread);
+  end = trace_varint(end, b->ref_time);
+  end = trace_varint(end, b->len);
+  pthread_mutex_lock(&trace.lock);
+  if (trace.file != NULL && b->session == atomic_load(&trace.session)) {
+    fwrite(head, 1, end - head, trace.file);
+    fwrite(b->data, 1, b->len, trace.file);
+  }
+  pthread_mutex_unlock(&trace.lock);
+  b->len = 0;
+  b->ref_time = b->last_time;
+  b->last_addr = 0;
+}
+
+/* Returns this thread's trace buffer, setting one up if it has
+   none, or a null pointer if memory is not available. */
+static struct trace_buf *trace_buf_get(void)
+{
+  struct trace_buf *b = tcache.trace;
+
+  if (b != NULL)
+    return b;
+  b = palloc_get_page(TRACE_BUF_PAGES);
+  if (b == NULL)
+    return NULL;
+  pthread_mutex_init(&b->lock, NULL);
+  b->session = 0;
+  b->len = 0;
+
+  /* Have tcache_destroy() write it out. */
+  if (tcache.id == 0)
+    tcache_register();
+  pthread_mutex_lock(&trace_reg.lock);
+  b->thread = ++trace_reg.threads;
+  list_push_back(&trace_reg.bufs, &b->elem);
+  pthread_mutex_unlock(&trace_reg.lock);
+  tcache.trace = b;
+  return b;
+}
+
+/* Records an event of type OP, one of the CY_TRACE_* constants, for
+   block OLD, NEW or both, of N bytes aligned to ALIGN, in this
+   thread's trace buffer. */
+static void trace_event(int op, const void *old, const void *new, size_t n,
+                        size_t align)
+{
+  struct trace_buf *b = trace_buf_get();
+  unsigned session;
+  uint64_t now;
+  uint8_t *p;
+
+  if (b == NULL)
     return;
+  pthread_mutex_lock(&b->lock);
+  if (!atomic_load(&trace.on)) {
+    pthread_mutex_unlock(&b->lock);
+    return;
+  }
 
-	pool = &mem_pool;
-  page_idx = pg_no(pages) - pg_no(pool->base);
+  /* Drop what is left of an earlier trace. */
+  session = atomic_load(&trace.session);
+  if (b->session != session) {
+    b->session = session;
+    b->len = 0;
+    b->ref_time = b->last_time = 0;
+    b->last_addr = 0;
+  }
 
-  assert(bitmap_all (pool->used_map, page_idx, page_cnt));
-  bitmap_set_multiple(pool->used_map, page_idx, page_cnt, false);  
+  now = now_ns() - atomic_load(&trace.start);
+  if (now < b->last_time)
+    now = b->last_time;
+  p = b->data + b->len;
+  *p++ = op;
+  p = trace_varint(p, now - b->last_time);
+  b->last_time = now;
+  if (op == CY_TRACE_REALLOC || op == CY_TRACE_FREE)
+    p = trace_addr(b, p, old);
+  if (op != CY_TRACE_FREE) {
+    p = trace_addr(b, p, new);
+    p = trace_varint(p, n);
+  }
+  if (op == CY_TRACE_ALIGNED)
+    p = trace_varint(p, align);
+  b->len = p - b->data;
+
+  if (b->len > TRACE_BUF_PAGES * PGSIZE - sizeof *b - TRACE_EVENT_MAX)
+    trace_flush(b);
+  pthread_mutex_unlock(&b->lock);
 }
 
-/* Returns the arena that block B is inside. */
-struct arena *block_to_arena(struct block *b)
+/* Ends a traced call that obtained block NEW, recording it as
+   trace_event() does unless the call failed. */
+static void trace_leave(int op, const void *old, const void *new, size_t n,
+                        size_t align)
 {
-  struct arena *a = pg_round_down(b);
+  tcache.tracing = false;
+  if (new != NULL)
+    trace_event(op, old, new, n, align);
+}
 
-  /* Check that the arena is valid. */
-  assert(a != NULL);
-  assert(a->magic == ARENA_MAGIC);
+/* Starts recording every allocation and free, by any thread, to a
+   new trace file at PATH.  Returns 1 on success, 0 if a trace is
+   already being recorded or the file cannot be written. */
+int cy_trace_start(const char *path)
+{
+  FILE *f;
 
-  /* Check that the block is properly aligned for the arena.*/
-  assert(a->desc == NULL
-          || (pg_ofs (b) - sizeof *a) % a->desc->block_size == 0);
-  assert(a->desc != NULL || pg_ofs (b) == sizeof *a); 
+  pthread_once(&tcache_once, tcache_key_create);
+  pthread_mutex_lock(&trace.lock);
+  if (trace.file != NULL) {
+    pthread_mutex_unlock(&trace.lock);
+    return 0;
+  }
+  f = fopen(path, "wb");
+  if (f == NULL) {
+    pthread_mutex_unlock(&trace.lock);
+    printf("[ERROR] cannot write %s\n", path);
+    return 0;
+  }
+  fwrite(CY_TRACE_MAGIC, 1, sizeof CY_TRACE_MAGIC - 1, f);
+  trace.file = f;
+  atomic_store(&trace.start, now_ns());
+  atomic_fetch_add(&trace.session, 1);
+  atomic_store(&trace.on, true);
+  pthread_mutex_unlock(&trace.lock);
+  return 1;
+}
 
-  return a;
+/* Stops recording the trace, writes out every thread's events and
+   closes the file.  Returns 1 on success, 0 if no trace was being
+   recorded or the file could not be written. */
+int cy_trace_stop(void)
+{
+  struct list_elem *e;
+  FILE *f;
+  int success;
+
+  pthread_once(&tcache_once, tcache_key_create);
+  atomic_store(&trace.on, false);
+  pthread_mutex_lock(&trace_reg.lock);
+  for (e = list_begin(&trace_reg.bufs); e != list_end(&trace_reg.bufs);
+       e = list_next(e)) {
+    struct trace_buf *b = list_entry(e, struct trace_buf, elem);
+
+    pthread_mutex_lock(&b->lock);
+    trace_flush(b);
+    pthread_mutex_unlock(&b->lock);
+  }
+  pthread_mutex_unlock(&trace_reg.lock);
+
+  pthread_mutex_lock(&trace.lock);
+  f = trace.file;
+  trace.file = NULL;
+  pthread_mutex_unlock(&trace.lock);
+  if (f == NULL)
+    return 0;
+  success = !ferror(f);
+  return fclose(f) == 0 && success;
+}
+
+/* Returns the number of bytes block P can hold, which may be more
+   than were asked for, or 0 if P is not a block. */
+size_t cy_usable_size(const void *p)
+{
+  struct arena *a = lookup_arena(p);
+
+  if (a == NULL)
+    return 0;
+  if (a->desc != NULL)
+    return a->desc->block_size;
+  return (uint8_t *) a->pages + a->free_cnt * PGSIZE - (uint8_t *) p;
+}
+
+/* Obtains and returns a new block of at least n bytes. 
+   Returns a null pointer if memory is not available.
+   Safe to call from any thread. */
+void *cy_malloc(size_t n) 
+{
+  /* A null pointer satisfies a request for 0 bytes. */
+  if (n == 0)
+    return NULL;
+  if (trace_wanted()) {
+    void *p;
+
+    tcache.tracing = true;
+    p = cy_malloc(n);
+    trace_leave(CY_TRACE_MALLOC, NULL, p, n, 0);
+    return p;
+  }
+  if (atomic_load_explicit(&size_sample, memory_order_relaxed) != 0)
+    size_sample_note(n, 1);
+  if ((tcache.prof_left -= n) < 0)
+    return prof_alloc(n, 0, __builtin_return_address(0));
+	
+  /* Look up the smallest descriptor that satisfies a SIZE-byte
+     request. */
+  if (n <= SMALL_MAX && size_classes[n] != CLASS_BIG)
+    return desc_alloc(size_classes[n] == DESC_MAX ? &requested_desc
+                      : &descs[size_classes[n]]);
+	
+  /* Big Block */
+  else
+    return big_block_alloc(n, 0);
+}    
+
+/* Obtains and returns a new block of at least N bytes aligned to
+   ALIGN, which must be a power of two.  Returns a null pointer if
+   memory is not available or ALIGN is not valid.  A block that fits
+   a size class comes from the smallest class whose blocks are all
+   aligned enough; any other is a big block, which starts on a page
+   boundary, or on a multiple of ALIGN if that is bigger.
+   Safe to call from any thread. */
+void *cy_aligned_alloc(size_t align, size_t n)
+{
+  struct desc *d;
+
+  if (align == 0 || (align & (align - 1)) != 0)
+    return NULL;
+  if (n == 0)
+    return NULL;
+  if (trace_wanted()) {
+    void *p;
+
+    tcache.tracing = true;
+    p = cy_aligned_alloc(align, n);
+    trace_leave(CY_TRACE_ALIGNED, NULL, p, n, align);
+    return p;
+  }
+  if ((tcache.prof_left -= n) < 0)
+    return prof_alloc(n, align, __builtin_return_address(0));
+
+  d = desc_aligned(n, align);
+  if (d != NULL)
+    return desc_alloc(d);
+  return big_block_alloc(n, align);
+}
+
+/* Same as cy_aligned_alloc(). */
+void *cy_memalign(size_t align, size_t n)
+{
+  return cy_aligned_alloc(align, n);
+}
+
+/* Stores in *P a new block of at least N bytes aligned to ALIGN, as
+   cy_aligned_alloc() obtains it.  Returns 0 on success, EINVAL if
+   ALIGN is not a power of two multiple of sizeof (void *), or
+   ENOMEM if memory is not available, leaving *P as it was. */
+int cy_posix_memalign(void **p, size_t align, size_t n)
+{
+  void *q;
+
+  if (align % sizeof (void *) != 0 || (align & (align - 1)) != 0
+      || align == 0)
+    return EINVAL;
+  if (n == 0) {
+    *p = NULL;
+    return 0;
+  }
+  q = cy_aligned_alloc(align, n);
+  if (q == NULL)
+    return ENOMEM;
+  *p = q;
+  return 0;
+}
+
+/* Returns the descriptor of the smallest size class that satisfies
+   an N-byte request with every block aligned to ALIGN, or a null
+   pointer if the request needs a big block. */
+static struct desc *desc_aligned(size_t n, size_t align)
+{
+  size_t i;
+
+  if (n < align)
+    n = align;
+  if (n > SMALL_MAX || size_classes[n] == CLASS_BIG)
+    return NULL;
+  if (size_classes[n] == DESC_MAX && requested_desc.align >= align)
+    return &requested_desc;
+  for (i = 0; i < desc_cnt; i++)
+    if (descs[i].block_size >= n && descs[i].align >= align)
+      return &descs[i];
+  return NULL;
+}
+
+/* Takes a block of D from this thread's cache, refilling it from
+   the descriptor if it is empty.  Returns a null pointer if memory
+   is not available. */
+static void *desc_alloc(struct desc *d)
+{
+  struct tcache_bin *bin = &tcache.bins[desc_idx(d)];
+  struct list_elem *e;
+
+  if (bin->cnt == 0 && !tcache_refill(d, bin, TCACHE_BATCH))
+    return NULL;
+  e = bin->head;
+  bin->head = e->next;
+  bin->cnt--;
+  stats_add(&tcache.bins[desc_idx(d)].stats.allocs, 1);
+  return list_entry(e, struct block, free_elem);
+}
+
+/* Obtains and returns a big block of at least N bytes aligned to
+   ALIGN, or to a page if ALIGN is 0.  Returns a null pointer if
+   memory is not available. */
+static void *big_block_alloc(size_t n, size_t align)
+{
+  struct arena *a;
+  uint8_t *pages, *b;
+  size_t page_cnt;
+
+  if (align <= PGSIZE) {
+    /* Allocate enough pages to hold N. */
+    page_cnt = DIV_ROUND_UP(n, PGSIZE);
+    pages = palloc_get_page(page_cnt);
+    if (pages == NULL)
+      return NULL;
+    b = pages;
+  }
+  else {
+    /* Allocate enough pages to hold N on an ALIGN boundary. */
+    size_t used;
+
+    if (n > SIZE_MAX - align)
+      return NULL;
+    page_cnt = DIV_ROUND_UP(n + align - PGSIZE, PGSIZE);
+    pages = palloc_get_page(page_cnt);
+    if (pages == NULL)
+      return NULL;
+    b = (uint8_t *) ROUND_UP((uintptr_t) pages, align);
+
+    /* Give back the pages after N that the alignment did not take. */
+    used = (b - pages) / PGSIZE + DIV_ROUND_UP(n, PGSIZE);
+    if (used < page_cnt && palloc_resize_page(pages, page_cnt, used))
+      page_cnt = used;
+  }
+
+  /* Initialize the arena to indicate a big block of PAGE_CNT pages,
+     and return it. */
+  a = page_to_arena(b);
+  a->magic = ARENA_MAGIC;
+  atomic_init(&a->sampled, 0);
+  a->desc = NULL;
+  a->free_cnt = page_cnt;
+  a->pages = pages;
+  if (tcache.id == 0)
+    tcache_register();
+  stats_add(&tcache.bins[STATS_BIG].stats.allocs, 1);
+  return b;
+}
+
+/* Frees block p, which must have been previously allocated with malloc().
+   Safe to call from any thread, not only the one that allocated p. */
+void cy_free(void *p)
+{
+  struct block *b = p;
+  struct arena *a;
+
+  if (trace_wanted())
+    trace_event(CY_TRACE_FREE, p, NULL, 0, 0);
+  a = lookup_arena(b);
+
+  /* Error handling */
+  if (a == NULL) {
+    printf("[ERROR] Failed to free %p\n", p);
+    return;
+  }
+  if (atomic_load_explicit(&a->sampled, memory_order_relaxed) != 0)
+    prof_free(a, p);
+
+  struct desc *d = a->desc;
+
+  /* Normal Block */
+  if (d != NULL) {
+    struct tcache_bin *bin = &tcache.bins[desc_idx(d)];
+
+    if (tcache.id == 0)
+      tcache_register();
+    stats_add(&tcache.bins[desc_idx(d)].stats.frees, 1);
+
+    /* Blocks of another thread's arena go back to that arena. */
+    if (atomic_load_explicit(&a->owner, memory_order_relaxed) != tcache.id) {
+      remote_free(d, a, b, b);
+      return;
+    }
+
+    /* Cache the block, returning a batch to the descriptor once
+       the cache is full. */
+    b->free_elem.next = bin->head;
+    bin->head = &b->free_elem;
+    if (++bin->cnt > TCACHE_MAX)
+      tcache_flush(d, bin, TCACHE_BATCH);
+  }
+
+  /* Big Block */
+  else {
+    if (tcache.id == 0)
+      tcache_register();
+    stats_add(&tcache.bins[STATS_BIG].stats.frees, 1);
+    arena_free(a);
+    return;
+  }
+}                        
+
+/* Frees block P, which must have been obtained with cy_malloc(),
+   cy_calloc() or cy_malloc_batch() for N bytes, or for any size of
+   the same size class.  The class comes from N, so a block of a
+   size class goes into this thread's cache without its arena being
+   read: that only happens once the cache is flushed back to the
+   descriptor, while the heap profiler holds samples, and in builds
+   with CY_DEBUG defined, which check that N is right.  Unlike cy_free(), the block is kept
+   here even if another thread owns its arena.
+   Safe to call from any thread. */
+void cy_free_sized(void *p, size_t n)
+{
+  struct desc *d;
+  struct tcache_bin *bin;
+  struct block *b = p;
+
+  /* Big Block */
+  if (n == 0 || n > SMALL_MAX || size_classes[n] == CLASS_BIG) {
+    cy_free(p);
+    return;
+  }
+
+  if (trace_wanted())
+    trace_event(CY_TRACE_FREE, p, NULL, 0, 0);
+  d = size_classes[n] == DESC_MAX ? &requested_desc : &descs[size_classes[n]];
+#ifdef CY_DEBUG
+  assert(block_to_arena(b)->desc == d);
+#endif
+  if (atomic_load_explicit(&prof_live, memory_order_relaxed) != 0) {
+    struct arena *a = block_to_arena(b);
+
+    if (atomic_load_explicit(&a->sampled, memory_order_relaxed) != 0)
+      prof_free(a, p);
+  }
+  if (tcache.id == 0)
+    tcache_register();
+
+  stats_add(&tcache.bins[desc_idx(d)].stats.frees, 1);
+
+  /* Cache the block, returning a batch to the descriptor once the
+     cache is full. */
+  bin = &tcache.bins[desc_idx(d)];
+  b->free_elem.next = bin->head;
+  bin->head = &b->free_elem;
+  if (++bin->cnt > TCACHE_MAX)
+    tcache_flush(d, bin, TCACHE_BATCH);
+}
+
+/* Obtains CNT new blocks of at least N bytes each and stores them
+   in OUT.  Returns the number of blocks obtained, which is less
+   than CNT only if memory ran out.  Blocks of a size class come
+   from this thread's cache and then, for the rest, from as many of
+   the descriptor's arenas as it takes in a single pass.
+   Safe to call from any thread. */
+size_t cy_malloc_batch(size_t n, size_t cnt, void **out)
+{
+  struct desc *d;
+  struct tcache_bin *bin;
+  size_t i;
+
+  if (n == 0)
+    return 0;
+  if (atomic_load_explicit(&size_sample, memory_order_relaxed) != 0)
+    size_sample_note(n, cnt);
+
+  /* Big Block */
+  if (n > SMALL_MAX || size_classes[n] == CLASS_BIG) {
+    for (i = 0; i < cnt; i++)
+      if ((out[i] = big_block_alloc(n, 0)) == NULL)
+        break;
+  }
+  else {
+    d = size_classes[n] == DESC_MAX ? &requested_desc : &descs[size_classes[n]];
+    bin = &tcache.bins[desc_idx(d)];
+    for (i = 0; i < cnt; i++) {
+      struct list_elem *e;
+
+      if (bin->cnt == 0 && !tcache_refill(d, bin, cnt - i))
+        break;
+      e = bin->head;
+      bin->head = e->next;
+      bin->cnt--;
+      out[i] = list_entry(e, struct block, free_elem);
+    }
+    stats_add(&tcache.bins[desc_idx(d)].stats.allocs, i);
+  }
+
+  if ((tcache.prof_left -= (int64_t) (n * i)) < 0)
+    prof_batch(n, i, out, __builtin_return_address(0));
+  if (trace_wanted()) {
+    size_t j;
+
+    for (j = 0; j < i; j++)
+      trace_event(CY_TRACE_MALLOC, NULL, out[j], n, 0);
+  }
+  return i;
+}
+
+/* Frees the CNT blocks in P, as cy_free() would each of them.
+   Blocks of the same arena that are next to each other in P go back
+   together: in one push onto its remote_free stack if another
+   thread owns it, or else into this thread's cache while it has
+   room, and then straight onto the arena's free list with one
+   update of its free count, under one lock for every run of blocks
+   of the same descriptor.  Safe to call from any thread. */
+void cy_free_batch(void **p, size_t cnt)
+{
+  struct desc *locked = NULL;
+  size_t i = 0;
+
+  if (trace_wanted()) {
+    size_t j;
+
+    for (j = 0; j < cnt; j++)
+      trace_event(CY_TRACE_FREE, p[j], NULL, 0, 0);
+  }
+  if (tcache.id == 0)
+    tcache_register();
+
+  while (i < cnt) {
+    struct block *first = p[i], *last = first;
+    struct arena *a = lookup_arena(first);
+    struct tcache_bin *bin;
+    struct desc *d;
+    size_t run = 1;
+
+    /* Error handling */
+    if (a == NULL) {
+      printf("[ERROR] Failed to free %p\n", p[i++]);
+      continue;
+    }
+    d = a->desc;
+
+    /* Big Block */
+    if (d == NULL) {
+      if (atomic_load_explicit(&a->sampled, memory_order_relaxed) != 0)
+        prof_free(a, first);
+      stats_add(&tcache.bins[STATS_BIG].stats.frees, 1);
+      arena_free(a);
+      i++;
+      continue;
+    }
+
+    /* Chain up the blocks that follow in the same arena. */
+    while (i + run < cnt && pg_round_down(p[i + run]) == a->pages
+           && lookup_arena(p[i + run]) == a) {
+      struct block *b = p[i + run];
+
+      last->free_elem.next = &b->free_elem;
+      last = b;
+      run++;
+    }
+    if (atomic_load_explicit(&a->sampled, memory_order_relaxed) != 0) {
+      size_t j;
+
+      for (j = i; j < i + run; j++)
+        prof_free(a, p[j]);
+    }
+    i += run;
+    stats_add(&tcache.bins[desc_idx(d)].stats.frees, run);
+
+    if (atomic_load_explicit(&a->owner, memory_order_relaxed) != tcache.id) {
+      remote_free(d, a, first, last);
+      continue;
+    }
+
+    /* Keep the blocks in this thread's cache while they fit. */
+    bin = &tcache.bins[desc_idx(d)];
+    if (bin->cnt + run <= TCACHE_MAX) {
+      last->free_elem.next = bin->head;
+      bin->head = &first->free_elem;
+      bin->cnt += run;
+      continue;
+    }
+    if (locked != d) {
+      if (locked != NULL)
+        pthread_mutex_unlock(&locked->lock);
+      locked = d;
+      pthread_mutex_lock(&d->lock);
+    }
+    desc_free_chain(d, a, first, last, run);
+  }
+  if (locked != NULL)
+    pthread_mutex_unlock(&locked->lock);
+}
+
+/* Changes the size of block P to N bytes and returns it, or a
+   null pointer if memory is not available, in which case P is
+   left as it was.  The block keeps its place whenever it can: a
+   block of a size class as long as N still fits in the class, a
+   big block by growing into or shrinking from the pages after it.
+   Only otherwise is it copied to a new block.
+   realloc(NULL, N) is cy_malloc(N); realloc(P, 0) is cy_free(P). */
+void *cy_realloc(void *p, size_t n)
+{
+  struct arena *a;
+  size_t old_size;
+  bool traced;
+  void *q;
+
+  if (p == NULL)
+    return cy_malloc(n);
+  if (n == 0) {
+    cy_free(p);
+    return NULL;
+  }
+
+  /* A traced call records its event before any of P's memory goes
+     back, as cy_free() does, so that no other thread can be handed
+     it and record that first.  The calls it makes are not
+     recorded. */
+  traced = trace_wanted();
+  if (traced)
+    tcache.tracing = true;
+
+  a = block_to_arena(p);
+  if (a->desc != NULL) {
+    /* Normal Block */
+    old_size = a->desc->block_size;
+    if (n <= old_size) {
+      if (traced)
+        trace_leave(CY_TRACE_REALLOC, p, p, n, 0);
+      return p;
+    }
+  }
+  else {
+    /* Big Block: resize its pages in place if it still has to be
+       a big block.  Shrinking always succeeds. */
+    uint8_t *pages = a->pages;
+    size_t page_cnt = DIV_ROUND_UP((uint8_t *) p - pages + n, PGSIZE);
+
+    old_size = pages + a->free_cnt * PGSIZE - (uint8_t *) p;
+    if (n > SMALL_MAX || size_classes[n] == CLASS_BIG) {
+      bool shrink = page_cnt <= a->free_cnt;
+
+      if (traced && shrink)
+        trace_event(CY_TRACE_REALLOC, p, p, n, 0);
+      if (palloc_resize_page(pages, a->free_cnt, page_cnt)) {
+        a->free_cnt = page_cnt;
+        if (traced && !shrink)
+          trace_event(CY_TRACE_REALLOC, p, p, n, 0);
+        if (traced)
+          tcache.tracing = false;
+        return p;
+      }
+    }
+  }
+
+  /* Copy as a last resort. */
+  q = cy_malloc(n);
+  if (q == NULL) {
+    if (traced)
+      trace_leave(CY_TRACE_REALLOC, p, NULL, n, 0);
+    return NULL;
+  }
+  memcpy(q, p, n < old_size ? n : old_size);
+  if (traced)
+    trace_event(CY_TRACE_REALLOC, p, q, n, 0);
+  cy_free(p);
+  if (traced)
+    tcache.tracing = false;
+  return q;
+}
+
+/* Obtains and returns a block of CNT elements of SIZE bytes each,
+   all zeros, or a null pointer if memory is not available or the
+   size overflows.  A big block is only cleared in the pages that
+   were not already known to be zero, so one of fresh or purged
+   pages costs nothing to clear. */
+void *cy_calloc(size_t cnt, size_t size)
+{
+  size_t n;
+  void *p;
+
+  if (size != 0 && cnt > SIZE_MAX / size)
+    return NULL;
+  n = cnt * size;
+  if (trace_wanted()) {
+    tcache.tracing = true;
+    p = cy_calloc(cnt, size);
+    trace_leave(CY_TRACE_CALLOC, NULL, p, n, 0);
+    return p;
+  }
+  p = cy_malloc(n);
+  if (p == NULL)
+    return NULL;
+
+  if (block_to_arena(p)->desc != NULL)
+    memset(p, 0, n);
+  else
+    palloc_zero(p, n);
+  return p;
+}
+
+/* Moves up to WANT blocks from D into BIN, creating new arenas as
+   needed.  Returns false if no block could be obtained. */
+static bool tcache_refill(struct desc *d, struct tcache_bin *bin,
+                          size_t want)
+{
+  size_t cnt;
+
+  if (tcache.id == 0)
+    tcache_register();
+
+  pthread_mutex_lock(&d->lock);
+  d->refills++;
+  if (atomic_load_explicit(&d->remote_arenas, memory_order_relaxed) != NULL)
+    desc_drain(d);
+  for (cnt = 0; cnt < want; ) {
+    struct arena *a;
+
+    /* Take blocks from the first partial arena, reusing a cached
+       empty arena or creating a new one if there is none. */
+    if (!list_empty(&d->partial))
+      a = list_entry(list_front(&d->partial), struct arena, partial_elem);
+    else if ((a = arena_cache_get(d)) != NULL) {
+      list_push_front(&d->partial, &a->partial_elem);
+      d->arena_cnt++;
+    }
+    else {
+      /* Allocate a page. */
+      void *page = arena_page_get(d);
+      if (page == NULL)
+        break;
+
+      /* Initialize arena. */
+      a = page_to_arena(page);
+      a->pages = page;
+      a->magic = ARENA_MAGIC;
+      atomic_init(&a->sampled, 0);
+      a->desc = d;
+      a->free_cnt = d->blocks_per_arena;
+      a->carved = 0;
+      a->free_list = NULL;
+      atomic_init(&a->remote_free, NULL);
+      list_push_front(&d->partial, &a->partial_elem);
+      d->arena_cnt++;
+    }
+    atomic_store_explicit(&a->owner, tcache.id, memory_order_relaxed);
+
+    /* Move blocks to the cache, preferring ones that have been
+       freed over carving new ones. */
+    for (; cnt < want && a->free_cnt > 0; cnt++) {
+      struct block *b;
+
+      if (a->free_list != NULL) {
+        b = list_entry(a->free_list, struct block, free_elem);
+        a->free_list = b->free_elem.next;
+      }
+      else
+        b = arena_to_block(a, a->carved++);
+      a->free_cnt--;
+      b->free_elem.next = bin->head;
+      bin->head = &b->free_elem;
+      bin->cnt++;
+    }
+    if (a->free_cnt == 0)
+      list_remove(&a->partial_elem);
+  }
+  pthread_mutex_unlock(&d->lock);
+  return bin->cnt > 0;
+}
+
+/* Returns CNT blocks from BIN to D. */
+static void tcache_flush(struct desc *d, struct tcache_bin *bin, size_t cnt)
+{
+  if (cnt == 0)
+    return;
+
+  pthread_mutex_lock(&d->lock);
+  for (; cnt > 0; cnt--) {
+    struct block *b = list_entry(bin->head, struct block, free_elem);
+
+    bin->head = b->free_elem.next;
+    bin->cnt--;
+    desc_free_block(d, b);
+  }
+  pthread_mutex_unlock(&d->lock);
+}
+
+/* Pushes the blocks of arena A chained from FIRST to LAST through
+   free_elem.next, where A belongs to descriptor D and is owned by
+   another thread, onto A's remote_free stack at once.  Lock-free. */
+static void remote_free(struct desc *d, struct arena *a, struct block *first,
+                        struct block *last)
+{
+  struct list_elem *old = atomic_load_explicit(&a->remote_free,
+                                               memory_order_relaxed);
+  struct arena *head;
+
+  do
+    last->free_elem.next = old;
+  while (!atomic_compare_exchange_weak_explicit(&a->remote_free, &old,
+                                                &first->free_elem,
+                                                memory_order_acq_rel,
+                                                memory_order_relaxed));
+  if (old != NULL)
+    return;
+
+  /* The stack was empty, so A is not queued for draining yet. */
+  head = atomic_load_explicit(&d->remote_arenas, memory_order_relaxed);
+  do
+    a->remote_next = head;
+  while (!atomic_compare_exchange_weak_explicit(&d->remote_arenas, &head, a,
+                                                memory_order_release,
+                                                memory_order_relaxed));
+}
+
+/* Returns every block freed remotely in D's arenas to D.
+   D's lock must be held. */
+static void desc_drain(struct desc *d)
+{
+  struct arena *a = atomic_exchange_explicit(&d->remote_arenas, NULL,
+                                             memory_order_acquire);
+
+  while (a != NULL) {
+    /* Read the link first: once A's stack is taken, a new remote
+       free may queue A again, which the acq_rel exchange orders
+       after this read. */
+    struct arena *next = a->remote_next;
+    struct list_elem *e = atomic_exchange_explicit(&a->remote_free, NULL,
+                                                   memory_order_acq_rel);
+
+    while (e != NULL) {
+      struct list_elem *e_next = e->next;
+
+      desc_free_block(d, list_entry(e, struct block, free_elem));
+      e = e_next;
+    }
+    a = next;
+  }
+}
+
+/* Returns every block freed remotely to its descriptor, releasing
+   the arenas that leaves empty. */
+static void descs_drain(void)
+{
+  size_t i;
+
+  for (i = 0; i <= desc_cnt; i++) {
+    struct desc *d = i == desc_cnt ? &requested_desc : &descs[i];
+
+    if (atomic_load_explicit(&d->remote_arenas, memory_order_relaxed) != NULL) {
+      pthread_mutex_lock(&d->lock);
+      desc_drain(d);
+      pthread_mutex_unlock(&d->lock);
+    }
+  }
+}
+
+/* Adds block B to its arena's free list, freeing the arena if that
+   leaves it entirely unused.  D's lock must be held. */
+static void desc_free_block(struct desc *d, struct block *b)
+{
+  desc_free_chain(d, block_to_arena(b), b, b, 1);
+}
+
+/* Adds the CNT blocks of arena A chained from FIRST to LAST through
+   free_elem.next to A's free list, freeing A if that leaves it
+   entirely unused.  D's lock must be held. */
+static void desc_free_chain(struct desc *d, struct arena *a, struct block *first,
+                            struct block *last, size_t cnt)
+{
+  /* Add blocks to free list.  A full arena becomes partial again,
+     behind the arenas that are already being allocated from. */
+  last->free_elem.next = a->free_list;
+  a->free_list = &first->free_elem;
+  if (a->free_cnt == 0)
+    list_push_back(&d->partial, &a->partial_elem);
+  a->free_cnt += cnt;
+
+  /* If the arena is now entirely unused, free it. */
+  if (a->free_cnt == d->blocks_per_arena) {
+    list_remove(&a->partial_elem);
+    d->arena_cnt--;
+    arena_cache_put(d, a);
+  }
+}
+
+/* Removes cached arena A, which belongs to D, from arena_cache.
+   arena_cache's lock must be held. */
+static void arena_cache_remove(struct desc *d, struct arena *a)
+{
+  list_remove(&a->partial_elem);
+  list_remove(&a->lru_elem);
+  d->cached_cnt--;
+  arena_cache.cnt--;
+}
+
+/* Returns the least recently cached arena, which must exist, after
+   removing it from arena_cache.  If D is non-null, only D's arenas
+   are considered.  arena_cache's lock must be held. */
+static struct arena *arena_cache_evict(struct desc *d)
+{
+  struct arena *a;
+
+  if (d != NULL)
+    a = list_entry(list_back(&d->cached), struct arena, partial_elem);
+  else
+    a = list_entry(list_back(&arena_cache.lru), struct arena, lru_elem);
+  arena_cache_remove(a->desc, a);
+  return a;
+}
+
+/* Keeps empty arena A of descriptor D in arena_cache, releasing the
+   least recently cached arena if that goes over a high-water mark.
+   D's lock must be held. */
+static void arena_cache_put(struct desc *d, struct arena *a)
+{
+  struct arena *victim = a;
+
+  pthread_mutex_lock(&arena_cache.lock);
+  if (arena_cache.max > 0 && arena_cache.class_max > 0) {
+    if (d->cached_cnt >= arena_cache.class_max)
+      victim = arena_cache_evict(d);
+    else if (arena_cache.cnt >= arena_cache.max)
+      victim = arena_cache_evict(NULL);
+    else
+      victim = NULL;
+    list_push_front(&d->cached, &a->partial_elem);
+    list_push_front(&arena_cache.lru, &a->lru_elem);
+    d->cached_cnt++;
+    arena_cache.cnt++;
+  }
+  pthread_mutex_unlock(&arena_cache.lock);
+
+  if (victim != NULL)
+    arena_free(victim);
+}
+
+/* Takes an empty arena for D out of arena_cache, or returns a null
+   pointer if the cache is empty.  The most recently cached of D's
+   own arenas is used as is; failing that, the least recently cached
+   arena of another descriptor is rebuilt for D.  D's lock must be
+   held. */
+static struct arena *arena_cache_get(struct desc *d)
+{
+  struct arena *a = NULL;
+
+  pthread_mutex_lock(&arena_cache.lock);
+  if (!list_empty(&d->cached)) {
+    a = list_entry(list_front(&d->cached), struct arena, partial_elem);
+    arena_cache_remove(d, a);
+  }
+  else if (arena_cache.cnt > 0) {
+    a = arena_cache_evict(NULL);
+    a->desc = d;
+    a->free_cnt = d->blocks_per_arena;
+    a->carved = 0;
+    a->free_list = NULL;
+  }
+  pthread_mutex_unlock(&arena_cache.lock);
+  return a;
+}
+
+/* Releases the least recently cached arenas until arena_cache is
+   within its limits and holds no more than MAX arenas. */
+static void arena_cache_trim(size_t max)
+{
+  struct list victims;
+
+  list_init(&victims);
+  pthread_mutex_lock(&arena_cache.lock);
+  if (max > arena_cache.max)
+    max = arena_cache.max;
+  while (arena_cache.cnt > max
+         || (arena_cache.cnt > 0 && arena_cache.class_max == 0)) {
+    struct arena *a = arena_cache_evict(NULL);
+    list_push_back(&victims, &a->partial_elem);
+  }
+  if (arena_cache.class_max > 0) {
+    size_t i;
+
+    for (i = 0; i <= desc_cnt; i++) {
+      struct desc *d = i == desc_cnt ? &requested_desc : &descs[i];
+
+      while (d->cached_cnt > arena_cache.class_max) {
+        struct arena *a = arena_cache_evict(d);
+        list_push_back(&victims, &a->partial_elem);
+      }
+    }
+  }
+  pthread_mutex_unlock(&arena_cache.lock);
+
+  while (!list_empty(&victims)) {
+    struct list_elem *e = list_pop_front(&victims);
+    arena_free(list_entry(e, struct arena, partial_elem));
+  }
+}
+
+/* Returns a monotonic timestamp in nanoseconds. */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns the time in ms since some fixed point. */
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Background purging thread: checks every pool against the decay
+   policy about twice per PURGE_DECAY ms until it is stopped. */
+static void *purger_main(void *aux)
+{
+  pthread_mutex_lock(&purger.lock);
+  while (purger.running) {
+    size_t decay = atomic_load(&purge_decay);
+    size_t wait_ms = decay == SIZE_MAX ? 1000 : decay / 2 + 1;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += wait_ms / 1000;
+    ts.tv_nsec += (wait_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&purger.cond, &purger.lock, &ts);
+    if (!purger.running)
+      break;
+
+    pthread_mutex_unlock(&purger.lock);
+    purge_pools(false);
+    pthread_mutex_lock(&purger.lock);
+  }
+  pthread_mutex_unlock(&purger.lock);
+  return aux;
+}
+
+/* Starts the background purging thread if START and it is not
+   running, or stops it if !START and it is.  Returns 1 on success,
+   0 if the thread cannot be created. */
+static int purger_set(bool start)
+{
+  int success = 1;
+
+  pthread_mutex_lock(&purger.lock);
+  if (start && !purger.running) {
+    purger.running = true;
+    if (pthread_create(&purger.thread, NULL, purger_main, NULL) != 0) {
+      purger.running = false;
+      success = 0;
+    }
+    pthread_mutex_unlock(&purger.lock);
+  }
+  else if (!start && purger.running) {
+    purger.running = false;
+    pthread_cond_signal(&purger.cond);
+    pthread_mutex_unlock(&purger.lock);
+    pthread_join(purger.thread, NULL);
+  }
+  else
+    pthread_mutex_unlock(&purger.lock);
+  return success;
+}
+
+/* Sets allocator parameter PARAM, one of the CY_M_* constants, to
+   VALUE.  Returns 1 on success, 0 if PARAM is unknown or VALUE is
+   not valid for it.
+   Lowering an arena cache limit releases arenas right away. */
+int cy_mallopt(int param, size_t value)
+{
+  switch (param) {
+    case CY_M_ARENA_CACHE:
+      pthread_mutex_lock(&arena_cache.lock);
+      arena_cache.class_max = value;
+      pthread_mutex_unlock(&arena_cache.lock);
+      arena_cache_trim(SIZE_MAX);
+      return 1;
+    case CY_M_ARENA_CACHE_TOTAL:
+      pthread_mutex_lock(&arena_cache.lock);
+      arena_cache.max = value;
+      pthread_mutex_unlock(&arena_cache.lock);
+      arena_cache_trim(SIZE_MAX);
+      return 1;
+
+    /* The page allocator can only be chosen before any pool exists. */
+    case CY_M_PAGE_ALLOC:
+      if (atomic_load(&pool_cnt) != 0
+          || (value != CY_PALLOC_BITMAP && value != CY_PALLOC_BUDDY
+              && value != CY_PALLOC_EXTENT))
+        return 0;
+      page_alloc = value;
+      return 1;
+    case CY_M_HUGEPAGE:
+      if (atomic_load(&pool_cnt) != 0)
+        return 0;
+      hugepage = value != 0;
+      return 1;
+
+    /* Size classes are laid out at init. */
+    case CY_M_SIZE_CLASSES:
+      if (desc_cnt != 0
+          || (value != CY_CLASSES_POW2 && value != CY_CLASSES_QUARTER))
+        return 0;
+      class_spacing = value;
+      return 1;
+    case CY_M_SIZE_SAMPLE:
+      atomic_store(&size_sample, value);
+      return 1;
+
+    /* Takes effect in this thread at once, and in the others within
+       PROF_RECHECK bytes. */
+    case CY_M_PROF_RATE:
+      atomic_store(&prof_rate, value);
+      tcache.prof_left = 0;
+      return 1;
+
+    case CY_M_PURGE_DECAY:
+      atomic_store(&purge_decay, value);
+      pthread_cond_signal(&purger.cond);
+      return 1;
+    case CY_M_PURGE_DIRTY_MAX:
+      atomic_store(&purge_dirty_max, value);
+      return 1;
+    case CY_M_PURGE_LAZY:
+#ifdef MADV_FREE
+      atomic_store(&purge_advice, value ? MADV_FREE : MADV_DONTNEED);
+      return 1;
+#else
+      return value == 0;
+#endif
+    case CY_M_PURGE_THREAD:
+      return purger_set(value != 0);
+    default:
+      return 0;
+  }
+}
+
+/* Returns the number of bytes at the base of a pool of PAGE_CNT
+   pages that its used_map (or other page allocator), dirty_map and
+   zero_map take.  Its arenas follow. */
+static size_t pool_maps_size(size_t page_cnt)
+{
+  size_t map_size = page_alloc == CY_PALLOC_BUDDY ? buddy_buf_size(page_cnt)
+                    : page_alloc == CY_PALLOC_EXTENT ? extent_buf_size(page_cnt)
+                    : bitmap_buf_size(page_cnt);
+
+  return ROUND_UP(map_size, sizeof (long))
+         + 2 * ROUND_UP(bitmap_buf_size(page_cnt), sizeof (long));
+}
+
+/* Returns the number of pages at the base of a pool of PAGE_CNT
+   pages that its used_map (or other page allocator) and the rest of
+   its metadata take. */
+static size_t pool_meta_pages(size_t page_cnt)
+{
+  return DIV_ROUND_UP(pool_maps_size(page_cnt)
+                      + page_cnt * sizeof (struct arena), PGSIZE);
+}
+
+/* Returns the end of the committed part of pool P's metadata: its
+   maps and the arena entries of its committed pages.  The arena
+   entries of the other pages are committed along with them, by
+   pool_commit(). */
+static void *pool_meta_end(const struct pool *p)
+{
+  return pg_round_up(&p->arenas[((uint8_t *) p->commit_end
+                                 - (uint8_t *) p->base) / PGSIZE]);
+}
+
+/* Initializes pool P with the PAGE_CNT pages at BASE, all of them
+   committed.  Returns false if they cannot even hold the pool's
+   used_map. */
+static bool init_pool(struct pool *p, void *base, size_t page_cnt)
+{
+  /* We'll put the pool's used_map (or other page allocator) at its
+	 base.  Calculate the space needed for it
+	 and subtract it from the pool's size. */
+  size_t bm_pages = pool_meta_pages(page_cnt);
+  size_t map_size, dirty_size;
+
+  /* Start the pages on a huge page boundary. */
+  if (hugepage)
+    bm_pages = (ROUND_UP((uintptr_t) base + bm_pages * PGSIZE, HPAGE_SIZE)
+                - (uintptr_t) base) / PGSIZE;
+  /* Error handling */
+  if (bm_pages >= page_cnt) {
+  	printf("[ERROR] Not enough memory for bitmap.\n");
+	  return false;
+  }
+  page_cnt -= bm_pages; 
+	
+  pthread_mutex_init(&p->lock, NULL);
+  map_size = ROUND_UP(page_alloc == CY_PALLOC_BUDDY ? buddy_buf_size(page_cnt)
+                      : page_alloc == CY_PALLOC_EXTENT ? extent_buf_size(page_cnt)
+                      : bitmap_buf_size(page_cnt), sizeof (long));
+  if (page_alloc == CY_PALLOC_BUDDY)
+    p->buddy = buddy_create_in_buf(page_cnt, base, map_size);
+  else if (page_alloc == CY_PALLOC_EXTENT)
+    p->extents = extent_create_in_buf(page_cnt, base, map_size);
+  else
+    p->used_map = bitmap_create_in_buf(page_cnt, base, map_size);
+  dirty_size = ROUND_UP(bitmap_buf_size(page_cnt), sizeof (long));
+  p->dirty_map = bitmap_create_in_buf(page_cnt, base + map_size, dirty_size);
+  p->zero_map = bitmap_create_in_buf(page_cnt, base + map_size + dirty_size,
+                                     dirty_size);
+  p->arenas = (struct arena *) (base + map_size + 2 * dirty_size);
+  p->used_cnt = 0;
+  p->dirty_cnt = 0;
+  p->anon = false;
+  p->start = base;
+  p->base = base + bm_pages * PGSIZE;
+  p->end = p->base + page_cnt * PGSIZE;
+  p->commit_end = p->end;
+  return true;
+}
+
+/* Adds a pool of the PAGE_CNT pages at START, of which those below
+   COMMIT_END are committed.  COMMIT_END may come before the pool's
+   pages, as long as its maps are committed; see pool_meta_end().
+   ANON says whether the pages are private
+   anonymous memory that we mapped and nobody has touched since, so
+   that the committed ones are zero.  Returns the pool, or a null
+   pointer if there are already POOL_MAX pools or the pages are too
+   few.  pools_lock must be held. */
+static struct pool *add_pool(void *start, size_t page_cnt, void *commit_end,
+                             bool anon)
+{
+  size_t cnt = atomic_load_explicit(&pool_cnt, memory_order_relaxed);
+  struct pool *p = &pools[cnt];
+  uintptr_t chunk;
+
+  if (cnt == POOL_MAX) {
+    printf("[ERROR] too many regions\n");
+    return NULL;
+  }
+  if (!init_pool(p, start, page_cnt))
+    return NULL;
+  if (commit_end < p->commit_end)
+    p->commit_end = commit_end > p->base ? commit_end : p->base;
+  p->anon = anon;
+  if (!anon)
+    memset(p->arenas, 0, bitmap_size(p->dirty_map) * sizeof *p->arenas);
+  if (anon && p->commit_end > p->base)
+    bitmap_set_multiple(p->zero_map, 0,
+                        ((uint8_t *) p->commit_end - (uint8_t *) p->base) / PGSIZE,
+                        true);
+#ifdef MADV_HUGEPAGE
+  if (hugepage)
+    madvise(p->base, (uint8_t *) p->end - (uint8_t *) p->base, MADV_HUGEPAGE);
+#endif
+
+  /* Map the pool's chunks to it before any of its pages can be
+     handed out. */
+  for (chunk = (uintptr_t) p->base >> CHUNK_SHIFT;
+       chunk <= ((uintptr_t) p->end - 1) >> CHUNK_SHIFT
+       && chunk < sizeof pool_map / sizeof *pool_map; chunk++)
+    atomic_store_explicit(&pool_map[chunk],
+                          atomic_load_explicit(&pool_map[chunk],
+                                               memory_order_relaxed) == 0
+                          ? cnt + 1 : POOL_SHARED,
+                          memory_order_relaxed);
+  atomic_store_explicit(&pool_cnt, cnt + 1, memory_order_release);
+  return p;
+}
+
+/* Adds the LEN bytes at BASE to the memory the allocator hands out,
+   as a new pool.  Only whole pages are used.  Returns 1 on success,
+   0 if the region is too small, overlaps a pool or there are
+   already POOL_MAX pools.  Safe to call from any thread, before or
+   after init_memory_allocator(). */
+int cy_add_region(void *base, size_t len)
+{
+  uintptr_t start = (uintptr_t) pg_round_up(base);
+  uintptr_t end = (uintptr_t) base + len;
+  size_t cnt, i;
+
+  /* Error handling */
+  if (end < (uintptr_t) base)
+    end = UINTPTR_MAX;
+  end = (uintptr_t) pg_round_down((void *) end);
+  if (start >= end) {
+    printf("[ERROR] region %p is smaller than a page\n", base);
+    return 0;
+  }
+
+  pthread_mutex_lock(&pools_lock);
+  cnt = atomic_load_explicit(&pool_cnt, memory_order_relaxed);
+  for (i = 0; i < cnt; i++)
+    if (start < (uintptr_t) pools[i].end
+        && end > (uintptr_t) pools[i].start) {
+      printf("[ERROR] region %p overlaps another\n", base);
+      pthread_mutex_unlock(&pools_lock);
+      return 0;
+    }
+  if (start < (uintptr_t) reserved.end && end > (uintptr_t) reserved.next) {
+    printf("[ERROR] region %p overlaps the reserved heap\n", base);
+    pthread_mutex_unlock(&pools_lock);
+    return 0;
+  }
+  if (add_pool((void *) start, (end - start) / PGSIZE, (void *) end,
+               false) == NULL) {
+    pthread_mutex_unlock(&pools_lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&pools_lock);
+  return 1;
+}
+
+/* Makes room for PAGE_CNT more pages after palloc_get_page() found
+   none in the first SEEN pools.  Returns true if there may be room
+   now: another thread added a pool meanwhile, or a pool of whole
+   chunks was carved out of the reserved address space.  Returns
+   false if the reservation, if any, is used up. */
+static bool grow_pools(size_t seen, size_t page_cnt)
+{
+  size_t chunk_size = (size_t) 1 << CHUNK_SHIFT;
+  size_t left, len, meta_pages = 0;
+  struct pool *p = NULL;
+
+  pthread_mutex_lock(&pools_lock);
+  if (atomic_load_explicit(&pool_cnt, memory_order_relaxed) != seen) {
+    pthread_mutex_unlock(&pools_lock);
+    return true;
+  }
+
+  /* Take as many whole chunks as the pools carved out so far, or
+     more if need be for PAGE_CNT pages after the pool's used_map,
+     rounded up to a power of two for the buddy allocator. */
+  if (page_alloc == CY_PALLOC_BUDDY) {
+    size_t pow2 = 1;
+
+    while (pow2 < page_cnt)
+      pow2 *= 2;
+    page_cnt = pow2;
+  }
+  left = reserved.end - reserved.next;
+  len = reserved.next - reserved.start;
+  if (len < chunk_size)
+    len = chunk_size;
+  if (len > POOL_PAGES_MAX * PGSIZE)
+    len = POOL_PAGES_MAX * PGSIZE;
+  for (; left > 0; len += chunk_size) {
+    if (len > left)
+      len = left;
+    meta_pages = pool_meta_pages(len / PGSIZE);
+    if (len / PGSIZE >= meta_pages + page_cnt || len == left
+        || len + chunk_size > POOL_PAGES_MAX * PGSIZE)
+      break;
+  }
+
+  /* Commit the maps before they are built.  The arena entries are
+     committed along with the pages. */
+  if (left > 0 && len / PGSIZE >= meta_pages + page_cnt) {
+    size_t commit = ROUND_UP(pool_maps_size(len / PGSIZE), PGSIZE);
+
+    if (mprotect(reserved.next, commit, PROT_READ | PROT_WRITE) == 0) {
+      p = add_pool(reserved.next, len / PGSIZE, reserved.next, true);
+      if (p != NULL)
+        reserved.next += len;
+    }
+  }
+  pthread_mutex_unlock(&pools_lock);
+  return p != NULL;
+}
+
+/* Returns the pool that page PAGES is in, or a null pointer if it
+   is in none. */
+static struct pool *pool_of(const void *pages)
+{
+  uintptr_t chunk = (uintptr_t) pages >> CHUNK_SHIFT;
+  size_t cnt, i;
+
+  if (chunk < sizeof pool_map / sizeof *pool_map) {
+    uint8_t idx = atomic_load_explicit(&pool_map[chunk], memory_order_relaxed);
+
+    if (idx != POOL_SHARED)
+      return idx == 0 ? NULL : &pools[idx - 1];
+  }
+
+  cnt = atomic_load_explicit(&pool_cnt, memory_order_acquire);
+  for (i = 0; i < cnt; i++)
+    if (pages >= pools[i].base && pages < pools[i].end)
+      return &pools[i];
+  return NULL;
+}
+
+/* Commits the pages of pool P up to END, a step at a time, along
+   with their arena entries.  Fresh pages are zero.  Each mprotect()
+   covers at most a chunk, which the kernel does not refuse as an
+   obvious overcommit the way it may a single call for more than the
+   machine has; a pool's pages are committed up to the highest one
+   handed out, which the buddy allocator may put far from the base.
+   Returns false if they cannot be committed.  P's lock must be
+   held. */
+static bool pool_commit(struct pool *p, void *end)
+{
+  uint8_t *commit_end;
+
+  if (end > p->end)
+    return false;
+  while (end > p->commit_end) {
+    uint8_t *meta_end = pool_meta_end(p), *new_meta_end;
+
+    commit_end = (uint8_t *) p->commit_end + ((size_t) 1 << CHUNK_SHIFT);
+    if (commit_end > (uint8_t *) ROUND_UP((uintptr_t) end, COMMIT_STEP))
+      commit_end = (uint8_t *) ROUND_UP((uintptr_t) end, COMMIT_STEP);
+    if (commit_end > (uint8_t *) p->end)
+      commit_end = p->end;
+    new_meta_end = pg_round_up(&p->arenas[(commit_end - (uint8_t *) p->base)
+                                          / PGSIZE]);
+    if (new_meta_end > meta_end
+        && mprotect(meta_end, new_meta_end - meta_end,
+                    PROT_READ | PROT_WRITE) != 0)
+      return false;
+    if (mprotect(p->commit_end, commit_end - (uint8_t *) p->commit_end,
+                 PROT_READ | PROT_WRITE) != 0)
+      return false;
+    if (p->anon)
+      bitmap_set_multiple(p->zero_map,
+                          ((uint8_t *) p->commit_end - (uint8_t *) p->base) / PGSIZE,
+                          (commit_end - (uint8_t *) p->commit_end) / PGSIZE,
+                          true);
+    p->commit_end = commit_end;
+  }
+  return true;
+}
+
+/* Accounts for the PAGE_CNT pages at page IDX of pool P being
+   handed out: they are in use now, whether or not they were dirty.
+   P's lock must be held. */
+static void pool_take(struct pool *p, size_t idx, size_t page_cnt)
+{
+  p->used_cnt += page_cnt;
+  if (p->dirty_cnt > 0) {
+    size_t dirty = bitmap_count(p->dirty_map, idx, page_cnt, true);
+
+    if (dirty > 0) {
+      bitmap_set_multiple(p->dirty_map, idx, page_cnt, false);
+      p->dirty_cnt -= dirty;
+    }
+  }
+}
+
+/* Accounts for the PAGE_CNT pages at page IDX of pool P being given
+   back at time NOW: they may still be resident, so they are dirty
+   until purged, and may have been written, so they are no longer
+   known to be zero.  P's lock must be held. */
+static void pool_give(struct pool *p, size_t idx, size_t page_cnt, uint64_t now)
+{
+  p->used_cnt -= page_cnt;
+  if (p->dirty_cnt == 0)
+    p->dirty_since = now;
+  bitmap_set_multiple(p->dirty_map, idx, page_cnt, true);
+  p->dirty_cnt += page_cnt;
+  if (p->anon)
+    bitmap_set_multiple(p->zero_map, idx, page_cnt, false);
+}
+
+/* Returns the index of a free page in pool P for a new arena of D
+   after marking it used, or BITMAP_ERROR if there is none that
+   keeps D's arenas packed.  The page comes from the huge page D's
+   last arena went into, or else from a huge page that is entirely
+   free, which D then packs its arenas into.  Requires the bitmap
+   page allocator.  P's lock must be held. */
+static size_t pool_scan_hpage(struct pool *p, struct desc *d)
+{
+  size_t page_cnt = bitmap_size(p->used_map);
+  size_t start, idx;
+
+  if (d->hpage >= p->base && d->hpage < p->end) {
+    start = ((uint8_t *) d->hpage - (uint8_t *) p->base) / PGSIZE;
+    idx = bitmap_scan(p->used_map, start, 1, false);
+    if (idx != BITMAP_ERROR && idx < start + HPAGE_PAGES) {
+      bitmap_mark(p->used_map, idx);
+      return idx;
+    }
+  }
+
+  /* Any run of HPAGE_PAGES free pages holds a free huge page if it
+     is long enough to reach past the next huge page boundary. */
+  for (start = 0;
+       (idx = bitmap_scan(p->used_map, start, HPAGE_PAGES, false)) != BITMAP_ERROR; ) {
+    start = ROUND_UP(idx, HPAGE_PAGES);
+    if (start + HPAGE_PAGES > page_cnt)
+      break;
+    if (!bitmap_contains(p->used_map, start, HPAGE_PAGES, true)) {
+      d->hpage = p->base + start * PGSIZE;
+      bitmap_mark(p->used_map, start);
+      return start;
+    }
+  }
+  return BITMAP_ERROR;
+}
+
+/* Obtains PAGE_CNT contiguous free pages from pool P, committing
+   them if need be, and returns the first of them, or a null pointer
+   if P does not have them.  If D is non-null, gets a page for one
+   of D's arenas with pool_scan_hpage(). */
+static void *pool_get_pages(struct pool *p, size_t page_cnt, struct desc *d)
+{
+  void *pages = NULL;
+  size_t page_idx;
+
+  pthread_mutex_lock(&p->lock);
+  if (d != NULL)
+    page_idx = pool_scan_hpage(p, d);
+  else if (page_alloc == CY_PALLOC_BUDDY)
+    page_idx = buddy_alloc(p->buddy, page_cnt);
+  else if (page_alloc == CY_PALLOC_EXTENT)
+    page_idx = extent_alloc(p->extents, page_cnt);
+  else
+    page_idx = bitmap_scan_and_flip(p->used_map, 0, page_cnt, false);
+
+  if (page_idx != BITMAP_ERROR) {
+    pages = p->base + (PGSIZE * page_idx);
+    if (pool_commit(p, pages + page_cnt * PGSIZE))
+      pool_take(p, page_idx, page_cnt);
+    else {
+      if (page_alloc == CY_PALLOC_BUDDY)
+        buddy_free(p->buddy, page_idx, page_cnt);
+      else if (page_alloc == CY_PALLOC_EXTENT)
+        extent_free(p->extents, page_idx, page_cnt);
+      else
+        bitmap_set_multiple(p->used_map, page_idx, page_cnt, false);
+      pages = NULL;
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return pages;
+}
+
+/* Obtains and returns a group of page_cnt contiguous free pages,
+   from the first pool that has them, growing into the reserved
+   address space if none does.
+   If too few pages are available, returns a null pointer. */
+void *palloc_get_page(size_t page_cnt)
+{
+  size_t cnt, i = 0;
+
+  if (page_cnt == 0)
+  	return NULL;
+
+  do {
+    cnt = atomic_load_explicit(&pool_cnt, memory_order_acquire);
+    for (; i < cnt; i++) {
+      void *pages = pool_get_pages(&pools[i], page_cnt, NULL);
+
+      if (pages != NULL)
+        return pages;
+    }
+  }
+  while (grow_pools(cnt, page_cnt));
+  return NULL;
+}
+
+/* Obtains and returns a page for a new arena of D, or a null
+   pointer if memory is not available.  With CY_M_HUGEPAGE and the
+   bitmap page allocator, the page keeps D's arenas packed into huge
+   pages of their own if any pool can; otherwise any free page will
+   do.  D's lock must be held. */
+static void *arena_page_get(struct desc *d)
+{
+  size_t cnt, i;
+
+  if (hugepage && page_alloc == CY_PALLOC_BITMAP) {
+    cnt = atomic_load_explicit(&pool_cnt, memory_order_acquire);
+    for (i = 0; i < cnt; i++) {
+      void *page = pool_get_pages(&pools[i], 1, d);
+
+      if (page != NULL)
+        return page;
+    }
+  }
+  return palloc_get_page(1);
+}
+
+/* Frees the page_cnt pages starting at pages. */
+void palloc_free_page(void *pages, size_t page_cnt)
+{
+  struct pool *pool;
+  size_t page_idx;
+  uint64_t now;
+
+  assert(pg_ofs(pages) == 0);
+  if (pages == NULL || page_cnt == 0)
+    return;
+
+	pool = pool_of(pages);
+  assert(pool != NULL);
+  assert(pages + page_cnt * PGSIZE <= pool->end);
+  page_idx = pg_no(pages) - pg_no(pool->base);
+
+  pthread_mutex_lock(&pool->lock);
+  if (page_alloc == CY_PALLOC_BUDDY)
+    buddy_free(pool->buddy, page_idx, page_cnt);
+  else if (page_alloc == CY_PALLOC_EXTENT)
+    extent_free(pool->extents, page_idx, page_cnt);
+  else {
+    assert(bitmap_all (pool->used_map, page_idx, page_cnt));
+    bitmap_set_multiple(pool->used_map, page_idx, page_cnt, false);  
+  }
+
+  now = now_ms();
+  pool_give(pool, page_idx, page_cnt, now);
+  pool_decay(pool, now);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Resizes the OLD_CNT pages at PAGES, obtained from
+   palloc_get_page(), in place to NEW_CNT pages.  Shrinking frees
+   the pages at the end; growing takes the free pages right after
+   them.  Returns false, changing nothing, if those are not free. */
+static bool palloc_resize_page(void *pages, size_t old_cnt, size_t new_cnt)
+{
+  struct pool *pool = pool_of(pages);
+  size_t page_idx;
+  bool success;
+
+  assert(pool != NULL);
+  if (new_cnt == old_cnt)
+    return true;
+  if (new_cnt == 0)
+    return false;
+  page_idx = pg_no(pages) - pg_no(pool->base);
+
+  pthread_mutex_lock(&pool->lock);
+  if (new_cnt > old_cnt
+      && !pool_commit(pool, pages + new_cnt * PGSIZE))
+    success = false;
+  else if (page_alloc == CY_PALLOC_BUDDY)
+    success = buddy_resize(pool->buddy, page_idx, old_cnt, new_cnt);
+  else if (page_alloc == CY_PALLOC_EXTENT)
+    success = extent_resize(pool->extents, page_idx, old_cnt, new_cnt);
+  else if (new_cnt < old_cnt) {
+    bitmap_set_multiple(pool->used_map, page_idx + new_cnt,
+                        old_cnt - new_cnt, false);
+    success = true;
+  }
+  else {
+    success = page_idx + new_cnt <= bitmap_size(pool->used_map)
+              && !bitmap_contains(pool->used_map, page_idx + old_cnt,
+                                  new_cnt - old_cnt, true);
+    if (success)
+      bitmap_set_multiple(pool->used_map, page_idx + old_cnt,
+                          new_cnt - old_cnt, true);
+  }
+
+  if (success && new_cnt > old_cnt)
+    pool_take(pool, page_idx + old_cnt, new_cnt - old_cnt);
+  else if (success && new_cnt < old_cnt) {
+    uint64_t now = now_ms();
+
+    pool_give(pool, page_idx + new_cnt, old_cnt - new_cnt, now);
+    pool_decay(pool, now);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return success;
+}
+
+/* Zeroes the LEN bytes at START, which must lie in pages that
+   palloc_get_page() handed out and that have not been written
+   since, except in the pages that were known to be zero when they
+   were handed out.  Their zero_map bits do not change until they
+   are freed, so the pool's lock is only taken to read them, and
+   the clearing itself runs unlocked, a run of pages at a time. */
+static void palloc_zero(void *start, size_t len)
+{
+  uint8_t *end = (uint8_t *) start + len;
+  struct pool *pool;
+  size_t idx, end_idx;
+
+  if (len == 0)
+    return;
+  pool = pool_of(start);
+  assert(pool != NULL);
+  idx = pg_no(start) - pg_no(pool->base);
+  end_idx = pg_no(end - 1) - pg_no(pool->base) + 1;
+
+  /* Fresh or purged pages need nothing. */
+  pthread_mutex_lock(&pool->lock);
+  if (bitmap_all(pool->zero_map, idx, end_idx - idx))
+    idx = end_idx;
+  pthread_mutex_unlock(&pool->lock);
+
+  while (idx < end_idx) {
+    uint8_t *lo, *hi;
+    size_t run;
+    bool zero;
+
+    /* Find the run of pages at IDX that are all known to be zero or
+       all not. */
+    pthread_mutex_lock(&pool->lock);
+    zero = bitmap_test(pool->zero_map, idx);
+    for (run = idx + 1;
+         run < end_idx && bitmap_test(pool->zero_map, run) == zero; run++)
+      continue;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!zero) {
+      lo = (uint8_t *) pool->base + idx * PGSIZE;
+      hi = (uint8_t *) pool->base + run * PGSIZE;
+      if (lo < (uint8_t *) start)
+        lo = start;
+      if (hi > end)
+        hi = end;
+      memset(lo, 0, hi - lo);
+    }
+    idx = run;
+  }
+}
+
+/* Purges the dirty pages of pool P, or if WHOLE_HPAGES only those
+   that fill whole huge pages.  Returns the number of pages purged.
+   P's lock must be held. */
+static size_t pool_purge(struct pool *p, bool whole_hpages)
+{
+  int advice = atomic_load_explicit(&purge_advice, memory_order_relaxed);
+  size_t purged = 0;
+  size_t idx = 0, end;
+
+  while (p->dirty_cnt > 0
+         && (idx = bitmap_scan(p->dirty_map, idx, 1, true)) != BITMAP_ERROR) {
+    size_t lo = idx, hi;
+
+    end = bitmap_scan(p->dirty_map, idx, 1, false);
+    if (end == BITMAP_ERROR)
+      end = bitmap_size(p->dirty_map);
+    hi = end;
+    if (whole_hpages) {
+      lo = ROUND_UP(lo, HPAGE_PAGES);
+      hi = ROUND_DOWN(hi, HPAGE_PAGES);
+    }
+    if (lo < hi) {
+      /* Our pages read back as zeros once the kernel drops them. */
+      if (madvise(p->base + lo * PGSIZE, (hi - lo) * PGSIZE, advice) == 0
+          && p->anon && advice == MADV_DONTNEED)
+        bitmap_set_multiple(p->zero_map, lo, hi - lo, true);
+      bitmap_set_multiple(p->dirty_map, lo, hi - lo, false);
+      p->dirty_cnt -= hi - lo;
+      purged += hi - lo;
+    }
+    idx = end;
+  }
+  return purged;
+}
+
+/* Purges pool P's dirty pages if the oldest of them has been dirty
+   for PURGE_DECAY ms by time NOW, or if there are too many of
+   them.  Returns the number of pages purged.  P's lock must be
+   held. */
+static size_t pool_decay(struct pool *p, uint64_t now)
+{
+  size_t decay = atomic_load_explicit(&purge_decay, memory_order_relaxed);
+
+  if (p->dirty_cnt == 0)
+    return 0;
+  if (p->dirty_cnt > atomic_load_explicit(&purge_dirty_max, memory_order_relaxed)
+      || (decay != SIZE_MAX && now - p->dirty_since >= decay)) {
+    /* Dirty pages left in partly used huge pages start a new
+       period. */
+    p->dirty_since = now;
+    return pool_purge(p, hugepage);
+  }
+  return 0;
+}
+
+/* Purges the dirty pages of every pool if ALL, or of the pools that
+   are due according to the decay policy.  Returns the number of
+   pages purged. */
+static size_t purge_pools(bool all)
+{
+  size_t cnt = atomic_load_explicit(&pool_cnt, memory_order_acquire);
+  uint64_t now = now_ms();
+  size_t purged = 0, i;
+
+  for (i = 0; i < cnt; i++) {
+    pthread_mutex_lock(&pools[i].lock);
+    purged += all ? pool_purge(&pools[i], false) : pool_decay(&pools[i], now);
+    pthread_mutex_unlock(&pools[i].lock);
+  }
+  return purged;
+}
+
+/* Takes back every block freed remotely, releases every cached
+   empty arena and purges every free page, returning as much memory
+   to the OS as possible.  Returns the number of bytes purged. */
+size_t cy_heap_trim(void)
+{
+  descs_drain();
+  arena_cache_trim(0);
+  return purge_pools(true) * PGSIZE;
+}
+
+/* Fills INFO with how much memory the pools take. */
+void cy_heap_info(struct cy_heap_info *info)
+{
+  size_t cnt = atomic_load_explicit(&pool_cnt, memory_order_acquire);
+  size_t i;
+
+  info->mapped = info->resident = info->dirty = 0;
+  for (i = 0; i < cnt; i++) {
+    struct pool *p = &pools[i];
+
+    pthread_mutex_lock(&p->lock);
+    info->mapped += (uint8_t *) pool_meta_end(p) - (uint8_t *) p->start
+                    + ((uint8_t *) p->commit_end - (uint8_t *) p->base);
+    info->resident += (uint8_t *) pool_meta_end(p) - (uint8_t *) p->start
+                      + (p->used_cnt + p->dirty_cnt) * PGSIZE;
+    info->dirty += p->dirty_cnt * PGSIZE;
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/* Fills ST with the counters of descriptor D, or of big blocks if D
+   is null, adding up every thread's.  stats_reg's lock must be
+   held. */
+static void class_stats(struct desc *d, struct cy_class_stats *st)
+{
+  size_t idx = d == NULL ? STATS_BIG : desc_idx(d);
+  struct list_elem *e;
+
+  memset(st, 0, sizeof *st);
+  st->allocs = stats_reg.allocs[idx];
+  st->frees = stats_reg.frees[idx];
+  for (e = list_begin(&stats_reg.tcaches); e != list_end(&stats_reg.tcaches);
+       e = list_next(e)) {
+    struct tcache *tc = list_entry(e, struct tcache, stats_elem);
+
+    st->allocs += atomic_load_explicit(&tc->bins[idx].stats.allocs,
+                                       memory_order_relaxed);
+    st->frees += atomic_load_explicit(&tc->bins[idx].stats.frees,
+                                      memory_order_relaxed);
+  }
+  /* A block may be counted as freed by one thread before another
+     counts it as allocated. */
+  st->live = st->allocs > st->frees ? st->allocs - st->frees : 0;
+  if (d == NULL) {
+    st->arenas = st->live;
+    return;
+  }
+
+  st->size = d->block_size;
+  pthread_mutex_lock(&d->lock);
+  st->arenas = d->arena_cnt;
+  st->blocks = d->arena_cnt * d->blocks_per_arena;
+  st->refills = d->refills;
+  for (e = list_begin(&d->partial); e != list_end(&d->partial);
+       e = list_next(e))
+    st->free_blocks += list_entry(e, struct arena, partial_elem)->free_cnt;
+  pthread_mutex_unlock(&d->lock);
+
+  pthread_mutex_lock(&arena_cache.lock);
+  st->cached = d->cached_cnt;
+  pthread_mutex_unlock(&arena_cache.lock);
+}
+
+/* Fills ST with the counters of every size class, big blocks and
+   pool.  Thread counters are only added up here, so they cost the
+   allocation paths nothing but a thread-local increment. */
+void cy_malloc_stats(struct cy_malloc_stats *st)
+{
+  size_t cnt = atomic_load_explicit(&pool_cnt, memory_order_acquire);
+  size_t i;
+
+  pthread_once(&tcache_once, tcache_key_create);
+  pthread_mutex_lock(&stats_reg.lock);
+  st->class_cnt = 0;
+  for (i = 0; i < desc_cnt; i++)
+    class_stats(&descs[i], &st->classes[st->class_cnt++]);
+  if (requested_desc.block_size != 0)
+    class_stats(&requested_desc, &st->classes[st->class_cnt++]);
+  class_stats(NULL, &st->classes[st->class_cnt++]);
+  pthread_mutex_unlock(&stats_reg.lock);
+
+  st->pool_cnt = cnt;
+  for (i = 0; i < cnt; i++) {
+    struct pool *p = &pools[i];
+    struct cy_pool_stats *ps = &st->pools[i];
+
+    pthread_mutex_lock(&p->lock);
+    ps->pages = bitmap_size(p->dirty_map);
+    ps->committed = ((uint8_t *) p->commit_end - (uint8_t *) p->base) / PGSIZE;
+    ps->used = p->used_cnt;
+    ps->dirty = p->dirty_cnt;
+    ps->largest_free = page_alloc == CY_PALLOC_BUDDY ? buddy_largest_free(p->buddy)
+                       : page_alloc == CY_PALLOC_EXTENT ? extent_largest_free(p->extents)
+                       : bitmap_longest_run(p->used_map);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/* Writes cy_malloc_stats() to F as a table if FORMAT is
+   CY_STATS_TEXT or as a JSON object if it is CY_STATS_JSON.
+   Returns 1 on success, 0 if FORMAT is unknown or F cannot be
+   written. */
+int cy_malloc_stats_print(FILE *f, int format)
+{
+  static struct cy_malloc_stats st;
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  size_t i;
+
+  if (format != CY_STATS_TEXT && format != CY_STATS_JSON)
+    return 0;
+
+  pthread_mutex_lock(&lock);
+  cy_malloc_stats(&st);
+  if (format == CY_STATS_TEXT) {
+    fprintf(f, "%8s %12s %12s %10s %8s %8s %10s %10s %10s\n", "size",
+            "allocs", "frees", "live", "arenas", "cached", "blocks",
+            "free", "refills");
+    for (i = 0; i < st.class_cnt; i++) {
+      struct cy_class_stats *c = &st.classes[i];
+
+      if (c->size == 0)
+        fprintf(f, "%8s", "big");
+      else
+        fprintf(f, "%8zu", c->size);
+      fprintf(f, " %12zu %12zu %10zu %8zu %8zu %10zu %10zu %10zu\n",
+              c->allocs, c->frees, c->live, c->arenas, c->cached,
+              c->blocks, c->free_blocks, c->refills);
+    }
+    fprintf(f, "%8s %12s %12s %10s %10s %12s\n", "pool", "pages",
+            "committed", "used", "dirty", "largest free");
+    for (i = 0; i < st.pool_cnt; i++) {
+      struct cy_pool_stats *p = &st.pools[i];
+
+      fprintf(f, "%8zu %12zu %12zu %10zu %10zu %12zu\n", i, p->pages,
+              p->committed, p->used, p->dirty, p->largest_free);
+    }
+  }
+  else {
+    fprintf(f, "{\"classes\": [");
+    for (i = 0; i < st.class_cnt; i++) {
+      struct cy_class_stats *c = &st.classes[i];
+
+      fprintf(f, "%s\n  {\"size\": %zu, \"allocs\": %zu, \"frees\": %zu, "
+              "\"live\": %zu, \"arenas\": %zu, \"cached\": %zu, "
+              "\"blocks\": %zu, \"free_blocks\": %zu, \"refills\": %zu}",
+              i == 0 ? "" : ",", c->size, c->allocs, c->frees, c->live,
+              c->arenas, c->cached, c->blocks, c->free_blocks, c->refills);
+    }
+    fprintf(f, "],\n \"pools\": [");
+    for (i = 0; i < st.pool_cnt; i++) {
+      struct cy_pool_stats *p = &st.pools[i];
+
+      fprintf(f, "%s\n  {\"pages\": %zu, \"committed\": %zu, \"used\": %zu, "
+              "\"dirty\": %zu, \"largest_free\": %zu}",
+              i == 0 ? "" : ",", p->pages, p->committed, p->used, p->dirty,
+              p->largest_free);
+    }
+    fprintf(f, "]}\n");
+  }
+  pthread_mutex_unlock(&lock);
+  return !ferror(f);
+}
+
+/* Returns the arena entry of page PAGE in its pool, or a null
+   pointer if PAGE is in no pool or has never been committed, in
+   which case its entry may not be either.  A pool's commit_end only
+   grows, so it is read without the pool's lock. */
+static struct arena *page_to_arena(const void *page)
+{
+  struct pool *pool = pool_of(page);
+
+  if (pool == NULL || page >= pool->commit_end)
+    return NULL;
+  return &pool->arenas[pg_no(page) - pg_no(pool->base)];
+}
+
+/* Returns the arena of block B, or a null pointer if B is not a
+   block that the allocator handed out.  Only the pool's arena
+   entries are read, never B's page. */
+static struct arena *lookup_arena(const void *b)
+{
+  struct arena *a;
+
+  if (b == NULL)
+    return NULL;
+  a = page_to_arena(b);
+  if (a == NULL || a->magic != ARENA_MAGIC)
+    return NULL;
+  if (a->desc == NULL ? pg_ofs (b) != 0
+      : pg_ofs (b) % a->desc->block_size != 0
+        || pg_ofs (b) / a->desc->block_size >= a->desc->blocks_per_arena)
+    return NULL;
+  return a;
+}
+
+/* Returns the arena that block B is inside. */
+struct arena *block_to_arena(struct block *b)
+{
+  struct arena *a = lookup_arena(b);
+
+  /* Check that the arena is valid and the block is properly
+     aligned for it. */
+  assert(a != NULL);
+  return a;
+}
+
+/* Releases arena A, of either kind, and its pages. */
+static void arena_free(struct arena *a)
+{
+  a->magic = 0;
+  palloc_free_page(a->pages, a->desc == NULL ? a->free_cnt : 1);
 }
 
 /* Returns the (IDX - 1)'th block within arena A. */
@@ -290,7 +3028,6 @@ static struct block *arena_to_block(struct arena *a, size_t idx)
   assert(a != NULL);
   assert(a->magic == ARENA_MAGIC);
   assert(idx < a->desc->blocks_per_arena); 
-  return (struct block *) ((uint8_t *) a
-                           + sizeof *a
+  return (struct block *) ((uint8_t *) a->pages
                            + idx * a->desc->block_size);
 }
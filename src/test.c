@@ -1,32 +1,38 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include "cy_malloc.h"
+#include "cy_extent.h"
 #include "cy_vaddr.h"
 
 
 int main (void) {
   printf("test begin\n");
 
-  /*To get the heap area address, do malloc.*/
-  uint64_t *a = malloc(8);
-  printf("[CYTEST] a: %p\n", a);
-  free(a);
-  printf("[CYTEST] a: %p\n", a);
+  /*Get two page-aligned areas of 20 pages each for the pools.*/
+  void *region1 = aligned_alloc(PGSIZE, PGSIZE * 20);
+  void *region2 = aligned_alloc(PGSIZE, PGSIZE * 20);
+  if (region1 == NULL || region2 == NULL) {
+    printf("[CYTEST] cannot allocate the regions\n");
+    return 1;
+  }
 
-  /*With ~PGMASK, set the least significant 12 bits to 0.*/
-  uint64_t *a_pg = (uint64_t *)((uintptr_t) a & ~PGMASK);
+  /*init_memory_allocator gets the first region by address.*/
+  uintptr_t start_addr = (uintptr_t) region1;
+  uintptr_t end_addr = start_addr + PGSIZE * 20;
 
-  /*Set the pool's size to have 20 pages.
-    init_memory_allocator gets the address by uint format.*/
-  uint64_t start_addr = (uint64_t) a_pg;
-  uint64_t end_addr = start_addr + (uint64_t)PGSIZE*20;
-
-  printf("[CYTEST] start_addr: %llx\n", start_addr);
+  printf("[CYTEST] start_addr: %#" PRIxPTR "\n", start_addr);
 
   printf("\n[CYTEST] --------init_memory_allocator--------\n");
   /*init_memory*/
   init_memory_allocator(start_addr, end_addr, 20);
 
+  /*The second region is added as another pool.*/
+  if (cy_add_region(region2, PGSIZE * 20))
+    printf("[CYTEST] region2 %p is added\n", region2);
+  else
+    printf("[CYTEST] region2 could not be added.\n");
+
   printf("\n[CYTEST] --------cy_malloc--------\n");
   /*malloc*/
   /*Allocate memory smaller than 16B(the minimum size).*/
@@ -64,6 +70,81 @@ int main (void) {
   else
     printf("[CYTEST] mem5K has a NULL pointer.\n");
 
+  /*Allocate a Big Block too big for what is left of region1,
+    so it comes from region2.*/
+  int *mem60K = cy_malloc(60000);
+  if (mem60K != NULL)
+    printf("[CYTEST] mem60K %p is allocated\n", mem60K);
+  else
+    printf("[CYTEST] mem60K has a NULL pointer.\n");
+
+
+  /*A block holds as much as its size class.*/
+  printf("[CYTEST] mem10 holds %zuB, mem20 %zuB, mem5K %zuB\n",
+         cy_usable_size(mem10), cy_usable_size(mem20), cy_usable_size(mem5K));
+
+
+  printf("\n[CYTEST] --------cy_realloc--------\n");
+  /*Grow the Big Block in place into the pages after it.*/
+  int *mem5K_old = mem5K;
+  mem5K = cy_realloc(mem5K, 9000);
+  if (mem5K == mem5K_old)
+    printf("[CYTEST] mem5K grew to 9000B in place at %p\n", mem5K);
+  else if (mem5K != NULL)
+    printf("[CYTEST] mem5K moved to %p to grow to 9000B\n", mem5K);
+  else
+    printf("[CYTEST] mem5K could not grow to 9000B\n");
+
+  printf("\n[CYTEST] --------cy_calloc--------\n");
+  /*A Big Block of zeros is cleared where its pages were written.*/
+  int *mem8K = cy_calloc(2000, sizeof *mem8K);
+  if (mem8K != NULL && mem8K[0] == 0 && mem8K[1999] == 0)
+    printf("[CYTEST] mem8K %p is allocated and zero\n", mem8K);
+  else
+    printf("[CYTEST] mem8K is not zero or has a NULL pointer.\n");
+  if (mem8K != NULL)
+    cy_free(mem8K);
+
+  /*A size that overflows gets a NULL pointer.*/
+  if (cy_calloc(SIZE_MAX / 2, 4) == NULL)
+    printf("[CYTEST] overflowing calloc has a NULL pointer\n");
+  else
+    printf("[CYTEST] overflowing calloc is allocated\n");
+
+  printf("\n[CYTEST] --------cy_aligned_alloc--------\n");
+  /*A small block comes from a size class aligned to its size.*/
+  int *mem64A = cy_aligned_alloc(64, 40);
+  if (mem64A != NULL && (uintptr_t) mem64A % 64 == 0)
+    printf("[CYTEST] mem64A %p is allocated 64B-aligned\n", mem64A);
+  else
+    printf("[CYTEST] mem64A is not aligned or has a NULL pointer.\n");
+
+  /*A Big Block starts on a page boundary.*/
+  int *mem8KA = cy_memalign(PGSIZE, 8000);
+  if (mem8KA != NULL && (uintptr_t) mem8KA % PGSIZE == 0)
+    printf("[CYTEST] mem8KA %p is allocated page-aligned\n", mem8KA);
+  else
+    printf("[CYTEST] mem8KA is not aligned or has a NULL pointer.\n");
+
+  /*An alignment that is not a power of two is refused.*/
+  void *memBad;
+  if (cy_posix_memalign(&memBad, 24, 100) != 0)
+    printf("[CYTEST] posix_memalign to 24B fails\n");
+  else
+    printf("[CYTEST] posix_memalign to 24B succeeds\n");
+  if (mem64A != NULL)
+    cy_free(mem64A);
+  if (mem8KA != NULL)
+    cy_free(mem8KA);
+
+  printf("\n[CYTEST] --------cy_malloc_batch--------\n");
+  /*Allocate and free eight blocks of 48B at once.*/
+  void *batch[8];
+  size_t batch_cnt = cy_malloc_batch(48, 8, batch);
+  printf("[CYTEST] %zu blocks of 48B are allocated, first %p\n",
+         batch_cnt, batch_cnt > 0 ? batch[0] : NULL);
+  cy_free_batch(batch, batch_cnt);
+  printf("[CYTEST] %zu blocks of 48B are freed\n", batch_cnt);
 
   printf("\n[CYTEST] --------cy_free--------\n");
   /*free*/
@@ -86,13 +167,77 @@ int main (void) {
   printf("[CYTEST] (after free) mem20: %d\n", *mem20);
 
 
+  /*mem32 is freed with its size.*/
   *mem32 = 15;
   printf("[CYTEST] (before free) mem32: %d\n", *mem32);
-  cy_free(mem32);
+  cy_free_sized(mem32, 32);
   printf("[CYTEST] (after free) mem32: %d\n", *mem32);
 
   *mem5K = 5000;
   printf("[CYTEST] (before free) mem5K: %d\n", *mem5K);
   cy_free(mem5K);
   printf("[CYTEST] (after free) mem5K: %d\n", *mem5K);
+
+  /*A pointer into the middle of a block is not freed.*/
+  cy_free((char *) mem60K + 100);
+
+  *mem60K = 60000;
+  printf("[CYTEST] (before free) mem60K: %d\n", *mem60K);
+  cy_free(mem60K);
+  printf("[CYTEST] (after free) mem60K: %d\n", *mem60K);
+
+
+  printf("\n[CYTEST] --------extent_alloc--------\n");
+  /*Free one extent of 100 pages, then 40 of 96 pages ahead of it in
+    the same bin, each kept apart by a page in use.  The only one
+    that holds 100 pages is still found.*/
+  enum { EXT_SHORT = 40, EXT_PAGES = 101 + EXT_SHORT * 97 };
+  size_t ext_size = extent_buf_size(EXT_PAGES), ext_idx[EXT_SHORT + 1], i;
+  void *ext_buf = malloc(ext_size);
+  if (ext_buf != NULL) {
+    struct extent_index *ext = extent_create_in_buf(EXT_PAGES, ext_buf, ext_size);
+    for (i = 0; i <= EXT_SHORT; i++) {
+      ext_idx[i] = extent_alloc(ext, i == 0 ? 100 : 96);
+      extent_alloc(ext, 1);
+    }
+    for (i = 0; i <= EXT_SHORT; i++)
+      extent_free(ext, ext_idx[i], i == 0 ? 100 : 96);
+    if (extent_alloc(ext, 100) == ext_idx[0])
+      printf("[CYTEST] 100 pages are found behind %d shorter extents\n",
+             EXT_SHORT);
+    else
+      printf("[CYTEST] 100 pages are not found behind %d shorter extents\n",
+             EXT_SHORT);
+    free(ext_buf);
+  }
+
+  printf("\n[CYTEST] --------cy_heap_profile--------\n");
+  /*Sample at a rate of one in every byte, so that every block is
+    recorded, and print the ones still live as folded stacks.*/
+  cy_mallopt(CY_M_PROF_RATE, 1);
+  void *prof100 = cy_malloc(100);
+  void *prof8K = cy_malloc(8192);
+  void *prof48 = cy_malloc(48);
+  cy_free(prof48);
+  cy_heap_profile_print(stdout, CY_PROF_FOLDED);
+  cy_free(prof100);
+  cy_free_sized(prof8K, 8192);
+  cy_mallopt(CY_M_PROF_RATE, 0);
+  printf("[CYTEST] after freeing them:\n");
+  cy_heap_profile_print(stdout, CY_PROF_FOLDED);
+
+  printf("\n[CYTEST] --------cy_trace--------\n");
+  /*Record a malloc, a realloc and a free.*/
+  if (cy_trace_start("/tmp/cy_test_trace.bin")) {
+    void *traced = cy_malloc(40);
+    traced = cy_realloc(traced, 4000);
+    cy_free(traced);
+    if (cy_trace_stop())
+      printf("[CYTEST] 3 events are traced to /tmp/cy_test_trace.bin\n");
+    remove("/tmp/cy_test_trace.bin");
+  }
+
+  printf("\n[CYTEST] --------cy_malloc_stats--------\n");
+  /*Every block but mem5K's neighbours has been freed.*/
+  cy_malloc_stats_print(stdout, CY_STATS_TEXT);
 }